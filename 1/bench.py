@@ -0,0 +1,118 @@
+import argparse
+import csv
+import itertools
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+parser = argparse.ArgumentParser(description = "Run the sorter on generated "\
+					       "datasets with different "\
+					       "coroutine counts and "\
+					       "latencies, save timings to CSV")
+parser.add_argument('-b', type=str, default='./bench_sort',
+		    help='sorter binary')
+parser.add_argument('-o', type=str, default='bench_sort.csv',
+		    help='CSV file for the results')
+parser.add_argument('--sizes', type=str, default='10000,100000',
+		    help='numbers per file')
+parser.add_argument('--files', type=str, default='6', help='file counts')
+parser.add_argument('--distributions', type=str,
+		    default='random,sorted,reverse,duplicates')
+parser.add_argument('--coroutines', type=str, default='1,3,6,12')
+parser.add_argument('--latencies', type=str, default='100,1000,10000',
+		    help='target latencies, microseconds')
+parser.add_argument('--threads', type=str, default='1',
+		    help='worker thread counts, -j of the sorter')
+parser.add_argument('-r', type=int, default=3, help='runs of each setup')
+parser.add_argument('--check', action='store_true',
+		    help='check the output of each setup once')
+args = parser.parse_args()
+
+def int_list(s):
+	return [int(x) for x in s.split(',')]
+
+here = os.path.dirname(os.path.abspath(__file__))
+binary = os.path.abspath(args.b)
+switch_re = re.compile(r'switch count after other function (\d+)')
+
+def generate(workdir, distribution, size, count):
+	"""Make the dataset files, the same for the same parameters."""
+	files = []
+	for i in range(count):
+		name = os.path.join(workdir, '{}_{}_{}.txt'.format(distribution,
+								   size, i))
+		if not os.path.exists(name):
+			subprocess.run([sys.executable,
+					os.path.join(here, 'generator.py'),
+					'-f', name, '-c', str(size),
+					'-d', distribution, '-s', str(i)],
+				       check=True)
+		files.append(name)
+	return files
+
+def check(workdir, total):
+	data = open(os.path.join(workdir, 'out.txt')).read().split()
+	numbers = [int(x) for x in data]
+	if len(numbers) != total:
+		return False
+	return all(numbers[i] <= numbers[i + 1]
+		   for i in range(len(numbers) - 1))
+
+def run(workdir, files, coroutines, latency, threads):
+	"""Returns wall time and switches per coroutine of one run."""
+	cmd = [binary]
+	if threads > 1:
+		cmd += ['-j', str(threads)]
+	cmd += [str(coroutines), str(latency)] + files
+	start = time.perf_counter()
+	res = subprocess.run(cmd, cwd=workdir, stdout=subprocess.PIPE,
+			     stderr=subprocess.STDOUT, check=True,
+			     universal_newlines=True)
+	wall = time.perf_counter() - start
+	switches = [int(x) for x in switch_re.findall(res.stdout)]
+	return wall, sum(switches) / max(len(switches), 1)
+
+columns = ['distribution', 'numbers_per_file', 'files', 'coroutines',
+	   'latency_us', 'threads', 'runs', 'wall_min_s', 'wall_median_s',
+	   'wall_max_s', 'switches_per_coroutine', 'numbers_per_s']
+
+with tempfile.TemporaryDirectory(prefix='bench_sort_') as workdir, \
+     open(args.o, 'w', newline='') as out:
+	writer = csv.writer(out)
+	writer.writerow(columns)
+	print(','.join(columns))
+	datasets = itertools.product(args.distributions.split(','),
+				     int_list(args.sizes),
+				     int_list(args.files))
+	for distribution, size, count in datasets:
+		files = generate(workdir, distribution, size, count)
+		total = size * count
+		setups = itertools.product(int_list(args.coroutines),
+					   int_list(args.latencies),
+					   int_list(args.threads))
+		for coroutines, latency, threads in setups:
+			walls = []
+			switches = []
+			for r in range(args.r):
+				wall, switch_count = run(workdir, files, coroutines,
+							 latency, threads)
+				walls.append(wall)
+				switches.append(switch_count)
+				if r == 0 and args.check and not check(workdir, total):
+					print('Wrong output: {} {}x{}, {} coroutines, '\
+					      '{} us'.format(distribution, count, size,
+							    coroutines, latency))
+					exit(1)
+			median = statistics.median(walls)
+			row = [distribution, size, count, coroutines, latency,
+			       threads, args.r, '%.4f' % min(walls),
+			       '%.4f' % median, '%.4f' % max(walls),
+			       '%.1f' % statistics.mean(switches),
+			       '%.0f' % (total / median)]
+			writer.writerow(row)
+			out.flush()
+			print(','.join(map(str, row)))
@@ -1,12 +1,18 @@
 #pragma once
 
+#include <stdatomic.h>
+#include "int_file.h"
+
 struct array_container {
 	int size;
 	int* array;
+	/** If the map is set, the array is in this mapped int file. */
+	struct int_file file;
 };
 
 struct filename_container {
 	int count;
-	int current_file_index;
+	/** Next file to sort, shared by all the coroutines. */
+	atomic_int current_file_index;
 	char** filenames;
 };
\ No newline at end of file
@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "external_sort.h"
+#include "kway_merge.h"
+#include "mergesort.h"
+#include "util.h"
+#include "int_file.h"
+#include "libcoro.h"
+
+enum {
+	/** Smallest read buffer of one run when merging, in bytes. */
+	RUN_BUFFER_MIN = 64 * 1024,
+	/** Largest read buffer of one run, in ints. */
+	RUN_BUFFER_MAX = 16 * 1024 * 1024,
+	/** Smallest part of a file sorted in memory, in ints. */
+	CHUNK_MIN = 16 * 1024,
+};
+
+/** What is left of @a budget after @a reserved bytes. */
+static size_t budget_left(size_t budget, size_t reserved){
+	return budget > reserved ? budget - reserved : 0;
+}
+
+int external_sort_create(struct external_sort* sort, size_t memory_budget, int worker_count){
+	/* The final output goes through a writer with its own buffer. */
+	sort->memory_budget = budget_left(memory_budget, NUMBER_WRITER_BUFFER_SIZE);
+	sort->worker_count = worker_count > 0 ? worker_count : 1;
+	sort->tmp_dir = getenv("TMPDIR");
+	if (sort->tmp_dir == NULL || *sort->tmp_dir == '\0')
+		sort->tmp_dir = "/tmp";
+	sort->runs = NULL;
+	sort->run_count = 0;
+	sort->run_capacity = 0;
+	return pthread_mutex_init(&sort->mutex, NULL) == 0 ? 0 : -1;
+}
+
+/** Close the files of the runs. Runs of one file are adjacent. */
+static void close_runs(struct sorted_run* runs, int count){
+	for (int i = 0; i < count; ++i){
+		if (i == 0 || runs[i].fd != runs[i - 1].fd)
+			close(runs[i].fd);
+	}
+}
+
+void external_sort_destroy(struct external_sort* sort){
+	close_runs(sort->runs, sort->run_count);
+	free(sort->runs);
+	sort->runs = NULL;
+	sort->run_count = 0;
+	pthread_mutex_destroy(&sort->mutex);
+}
+
+/** Create a temporary file, deleted once closed. */
+static int tmp_file_open(struct external_sort* sort){
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/sort_run_XXXXXX", sort->tmp_dir);
+	int fd = mkstemp(path);
+	if (fd >= 0)
+		unlink(path);
+	return fd;
+}
+
+static int write_all(int fd, const void* data, size_t size){
+	const char* pos = data;
+	while (size > 0){
+		ssize_t rc = coro_write(fd, pos, size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+static int read_all_at(int fd, void* data, size_t size, off_t offset){
+	char* pos = data;
+	while (size > 0){
+		ssize_t rc = coro_pread(fd, pos, size, offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+		pos += rc;
+		size -= rc;
+		offset += rc;
+	}
+	return 0;
+}
+
+/** Append the runs of one file, keeping them adjacent. */
+static int add_runs(struct external_sort* sort, struct sorted_run* runs, int count){
+	int rc = 0;
+	pthread_mutex_lock(&sort->mutex);
+	if (sort->run_count + count > sort->run_capacity){
+		int capacity = sort->run_capacity * 2;
+		if (capacity < sort->run_count + count)
+			capacity = sort->run_count + count;
+		struct sorted_run* new_runs = realloc(sort->runs, capacity * sizeof(*new_runs));
+		if (new_runs == NULL){
+			rc = -1;
+			goto unlock;
+		}
+		sort->runs = new_runs;
+		sort->run_capacity = capacity;
+	}
+	memcpy(sort->runs + sort->run_count, runs, count * sizeof(*runs));
+	sort->run_count += count;
+unlock:
+	pthread_mutex_unlock(&sort->mutex);
+	return rc;
+}
+
+ssize_t external_sort_spill(
+	struct external_sort* sort, int fd){
+		/* The chunk and the sort scratch buffer of the same size. */
+		size_t chunk_size = sort->memory_budget / sort->worker_count / (2 * sizeof(int));
+		if (chunk_size < CHUNK_MIN)
+			chunk_size = CHUNK_MIN;
+		if (chunk_size > INT32_MAX / 2)
+			chunk_size = INT32_MAX / 2;
+
+		ssize_t total = -1;
+		struct sorted_run* runs = NULL;
+		int run_count = 0;
+		int run_capacity = 0;
+		int tmp_fd = -1;
+		off_t offset = 0;
+		/* All the buffers of the spill are released at once. */
+		struct coro_alloc_mark mark = coro_alloc_mark();
+		int* chunk = coro_alloc(chunk_size * sizeof(int));
+		struct number_reader reader;
+		if (chunk == NULL || number_reader_create(&reader, fd) != 0){
+			coro_alloc_rewind(mark);
+			return -1;
+		}
+		/* A binary int file is copied by chunks from its mapping. */
+		struct int_file file = {0};
+		int rc = int_file_map(fd, &file);
+		if (rc < 0)
+			goto error;
+		bool is_mapped = rc == 0;
+		size_t file_pos = 0;
+
+		ssize_t count = 0;
+		while (true){
+			int size;
+			if (is_mapped){
+				size = file.count - file_pos < chunk_size ? file.count - file_pos : chunk_size;
+				memcpy(chunk, file.array + file_pos, size * sizeof(int));
+				file_pos += size;
+			}
+			else
+				size = number_reader_read(&reader, chunk, chunk_size);
+			if (size < 0)
+				goto error;
+			if (size == 0)
+				break;
+			if (custom_mergesort(chunk, size, sizeof(int), int_lt_cmp) != 0)
+				goto error;
+
+			if (tmp_fd < 0 && (tmp_fd = tmp_file_open(sort)) < 0)
+				goto error;
+			if (write_all(tmp_fd, chunk, size * sizeof(int)) != 0)
+				goto error;
+			if (run_count == run_capacity){
+				int new_capacity = run_capacity == 0 ? 8 : run_capacity * 2;
+				struct sorted_run* new_runs = coro_alloc_grow(runs, run_capacity * sizeof(*runs), new_capacity * sizeof(*runs));
+				if (new_runs == NULL)
+					goto error;
+				runs = new_runs;
+				run_capacity = new_capacity;
+			}
+			runs[run_count++] = (struct sorted_run){tmp_fd, offset, size};
+			offset += size * sizeof(int);
+			count += size;
+		}
+
+		if (run_count > 0 && add_runs(sort, runs, run_count) != 0)
+			goto error;
+		/* The file now belongs to the runs. */
+		tmp_fd = -1;
+		total = count;
+
+error:
+		if (tmp_fd >= 0)
+			close(tmp_fd);
+		int_file_unmap(&file);
+		coro_alloc_rewind(mark);
+		return total;
+	}
+
+/** A run being merged, read by portions into a buffer. */
+struct run_source {
+	struct merge_source base;
+	/** What is left to read. */
+	struct sorted_run run;
+	int* buffer;
+	size_t capacity;
+};
+
+static int run_source_refill(struct merge_source* source){
+	struct run_source* rs = source->ctx;
+	if (rs->run.count == 0)
+		return 0;
+	size_t count = rs->run.count < rs->capacity ? rs->run.count : rs->capacity;
+	if (read_all_at(rs->run.fd, rs->buffer, count * sizeof(int), rs->run.offset) != 0)
+		return -1;
+	rs->run.offset += count * sizeof(int);
+	rs->run.count -= count;
+	source->pos = rs->buffer;
+	source->end = rs->buffer + count;
+	return count;
+}
+
+/** Merge the runs into @a writer with @a budget bytes of buffers. */
+static int merge_runs(struct sorted_run* runs, int count, size_t budget, struct number_writer* writer){
+	size_t capacity = budget / count / sizeof(int);
+	if (capacity < RUN_BUFFER_MIN / sizeof(int))
+		capacity = RUN_BUFFER_MIN / sizeof(int);
+	if (capacity > RUN_BUFFER_MAX)
+		capacity = RUN_BUFFER_MAX;
+
+	int rc = -1;
+	struct coro_alloc_mark mark = coro_alloc_mark();
+	struct run_source* run_sources = coro_alloc(count * sizeof(*run_sources));
+	struct merge_source* sources = coro_alloc(count * sizeof(*sources));
+	if (run_sources == NULL || sources == NULL)
+		goto out;
+	memset(sources, 0, count * sizeof(*sources));
+	for (int i = 0; i < count; ++i){
+		run_sources[i].run = runs[i];
+		run_sources[i].capacity = capacity;
+		run_sources[i].buffer = coro_alloc(capacity * sizeof(int));
+		if (run_sources[i].buffer == NULL)
+			goto out;
+		sources[i].refill = run_source_refill;
+		sources[i].ctx = &run_sources[i];
+	}
+	rc = kway_merge(sources, count, writer);
+
+out:
+	coro_alloc_rewind(mark);
+	return rc;
+}
+
+/**
+ * One merge pass: groups of runs are taken by coroutines and
+ * merged into new runs. Or into the final output, when there is
+ * one group.
+ */
+struct merge_pass {
+	struct external_sort* sort;
+	struct sorted_run* runs;
+	int run_count;
+	int group_size;
+	int group_count;
+	/** Budget of one coroutine. */
+	size_t budget;
+	atomic_int next_group;
+	atomic_bool is_failed;
+	/** New runs, one per group. */
+	struct sorted_run* results;
+	/** Final output, instead of the new runs. */
+	struct number_writer* writer;
+};
+
+static int merge_pass_f(void* arg){
+	struct merge_pass* pass = arg;
+	int group;
+	while ((group = atomic_fetch_add(&pass->next_group, 1)) < pass->group_count){
+		int first = group * pass->group_size;
+		int count = pass->run_count - first;
+		if (count > pass->group_size)
+			count = pass->group_size;
+		struct sorted_run* runs = pass->runs + first;
+
+		if (pass->writer != NULL){
+			if (merge_runs(runs, count, pass->budget, pass->writer) != 0)
+				atomic_store(&pass->is_failed, true);
+			continue;
+		}
+
+		struct sorted_run* result = &pass->results[group];
+		result->offset = 0;
+		result->count = 0;
+		for (int i = 0; i < count; ++i)
+			result->count += runs[i].count;
+		result->fd = tmp_file_open(pass->sort);
+		struct number_writer writer;
+		if (result->fd < 0 || number_writer_create(&writer, result->fd, true) != 0){
+			atomic_store(&pass->is_failed, true);
+			continue;
+		}
+		int rc = merge_runs(runs, count, pass->budget, &writer);
+		if (number_writer_destroy(&writer) != 0 || rc != 0)
+			atomic_store(&pass->is_failed, true);
+	}
+	return 0;
+}
+
+/** Run the pass on up to worker_count coroutines and wait for them. */
+static int merge_pass_run(struct merge_pass* pass, int worker_count){
+	atomic_init(&pass->next_group, 0);
+	atomic_init(&pass->is_failed, false);
+	if (worker_count > pass->group_count)
+		worker_count = pass->group_count;
+	for (int i = 0; i < worker_count; ++i)
+		coro_new(merge_pass_f, pass);
+	struct coro* c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	return atomic_load(&pass->is_failed) ? -1 : 0;
+}
+
+int external_sort_merge(struct external_sort* sort, struct number_writer* writer){
+	size_t budget = sort->memory_budget;
+	int worker_count = sort->worker_count;
+	/* Each coroutine of a pass also writes its new run via a writer. */
+	size_t worker_budget = budget_left(budget / worker_count, NUMBER_WRITER_BUFFER_SIZE);
+	/* How many runs fit into the budget in one merge. */
+	size_t final_fan_in = budget / RUN_BUFFER_MIN;
+	size_t fan_in = worker_budget / RUN_BUFFER_MIN;
+	if (final_fan_in < 2)
+		final_fan_in = 2;
+	if (fan_in < 2)
+		fan_in = 2;
+
+	while ((size_t)sort->run_count > final_fan_in){
+		struct merge_pass pass;
+		pass.sort = sort;
+		pass.runs = sort->runs;
+		pass.run_count = sort->run_count;
+		pass.group_size = fan_in;
+		pass.group_count = (pass.run_count + fan_in - 1) / fan_in;
+		pass.budget = worker_budget;
+		pass.writer = NULL;
+		pass.results = calloc(pass.group_count, sizeof(struct sorted_run));
+		if (pass.results == NULL)
+			return -1;
+		for (int i = 0; i < pass.group_count; ++i)
+			pass.results[i].fd = -1;
+		int rc = merge_pass_run(&pass, worker_count);
+
+		/* The old runs are not needed anymore in any case. */
+		close_runs(sort->runs, sort->run_count);
+		free(sort->runs);
+		sort->runs = pass.results;
+		sort->run_count = pass.group_count;
+		sort->run_capacity = pass.group_count;
+		if (rc != 0)
+			return -1;
+	}
+
+	if (sort->run_count == 0)
+		return 0;
+	struct merge_pass pass;
+	pass.sort = sort;
+	pass.runs = sort->runs;
+	pass.run_count = sort->run_count;
+	pass.group_size = sort->run_count;
+	pass.group_count = 1;
+	pass.budget = budget;
+	pass.writer = writer;
+	pass.results = NULL;
+	return merge_pass_run(&pass, 1);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct number_writer;
+
+/** Sorted binary ints at an offset of a temporary file. */
+struct sorted_run {
+	int fd;
+	off_t offset;
+	size_t count;
+};
+
+/**
+ * Sorting of files which do not fit into memory. The files are
+ * split into sorted runs spilled to temporary files, and then the
+ * runs are merged with bounded read buffers, in several passes if
+ * there are too many of them. Everything is done by coroutines,
+ * the disk I/O goes via coro_pread() and coro_write().
+ */
+struct external_sort {
+	/**
+	 * Memory for the sort buffers, in bytes. It is the budget given
+	 * to external_sort_create() less the output writer buffer.
+	 */
+	size_t memory_budget;
+	/** Coroutines working at the same time, sharing the budget. */
+	int worker_count;
+	/** Where the temporary files go, $TMPDIR or /tmp. */
+	const char* tmp_dir;
+	pthread_mutex_t mutex;
+	/** Runs of one file are next to each other. */
+	struct sorted_run* runs;
+	int run_count;
+	int run_capacity;
+};
+
+int external_sort_create(struct external_sort* sort, size_t memory_budget, int worker_count);
+
+/** Close and thereby delete all the temporary files. */
+void external_sort_destroy(struct external_sort* sort);
+
+/**
+ * Split the file into sorted runs. Called by the coroutines, one
+ * file each. The sort yields as custom_mergesort() does. Returns
+ * the count of numbers in the file, or -1 on error.
+ */
+ssize_t external_sort_spill(
+	struct external_sort* sort, int fd);
+
+/**
+ * Merge all the runs into @a writer. Must be called outside of
+ * coroutines, when the spilling is over. Starts coroutines and
+ * waits for them. Returns 0 on success, -1 on error.
+ */
+int external_sort_merge(struct external_sort* sort, struct number_writer* writer);
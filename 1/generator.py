@@ -1,5 +1,9 @@
 import random
 import argparse
+import array
+import struct
+import sys
+import zlib
 
 maxint = 1 << 31
 
@@ -7,15 +11,44 @@ parser = argparse.ArgumentParser(description = "Generate random numbers file")
 parser.add_argument('-f', type=str, required=True, help="file name")
 parser.add_argument('-c', type=int, required=True, help='number count')
 parser.add_argument('-m', type=int, default=maxint, help='maximal number')
+parser.add_argument('-b', action='store_true', help='binary int32 file, '\
+		    'see int_file.h')
+parser.add_argument('-d', type=str, default='random',
+		    choices=['random', 'sorted', 'reverse', 'duplicates'],
+		    help='distribution of the numbers')
+parser.add_argument('-s', type=int, default=None,
+		    help='random seed, for the same file each time')
 args = parser.parse_args()
-random.seed()
+random.seed(args.s)
 
+m = args.m
+if args.b:
+	# int32 can't hold 1 << 31.
+	m = min(m, maxint - 1)
+if args.d == 'duplicates':
+	# A few distinct values, each repeated many times.
+	values = [random.randint(0, m) for i in range(16)]
+	numbers = [random.choice(values) for i in range(args.c)]
+else:
+	numbers = [random.randint(0, m) for i in range(args.c)]
+if args.d == 'sorted':
+	numbers.sort()
+elif args.d == 'reverse':
+	numbers.sort(reverse=True)
 
-f = open(args.f, 'w')
-
-for i in range(0, args.c):
-	f.write(str(random.randint(0, args.m)))
-	if i + 1 != args.c:
-		f.write(' ')
+if args.b:
+	data = array.array('i', numbers)
+	if sys.byteorder != 'little':
+		data.byteswap()
+	data = data.tobytes()
+	header = struct.pack('<8sIIQII', b'SORTINTS', 1, 32, args.c,
+			     zlib.crc32(data), 0)
+	f = open(args.f, 'wb')
+	f.write(header)
+	f.write(data)
+	f.close()
+	exit(0)
 
+f = open(args.f, 'w')
+f.write(' '.join(map(str, numbers)))
 f.close()
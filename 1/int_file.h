@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Binary file of ints, made by generator.py -b. A header, and
+ * then the ints as they are in memory: little-endian int32. Such
+ * a file needs no parsing, it is mapped and sorted right there.
+ */
+
+#define INT_FILE_MAGIC "SORTINTS"
+
+enum {
+	INT_FILE_VERSION = 1,
+};
+
+struct int_file_header {
+	char magic[8];
+	uint32_t version;
+	/** Where the ints start. */
+	uint32_t header_size;
+	uint64_t count;
+	/** CRC-32 of the ints, the same as zlib.crc32(). */
+	uint32_t checksum;
+	uint32_t reserved;
+};
+
+/** A mapped int file. */
+struct int_file {
+	void* map;
+	size_t map_size;
+	int* array;
+	size_t count;
+};
+
+/**
+ * Map an int file privately: the ints can be changed in place,
+ * while the file stays intact. The checksum is verified, with
+ * coro_yield_if_due() on the way. Returns 0 on success, 1 if it
+ * is not an int file, -1 if it is broken or on an error.
+ */
+int int_file_map(int fd, struct int_file* file);
+
+void int_file_unmap(struct int_file* file);
+
+/** Continue CRC-32 @a crc over the data. Start with 0. */
+uint32_t int_file_crc32(uint32_t crc, const void* data, size_t size);
@@ -0,0 +1,409 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include "kway_merge.h"
+#include "util.h"
+#include "libcoro.h"
+
+enum {
+	/** How many numbers are merged between checks of the time slice. */
+	KWAY_MERGE_YIELD_STEP = 4096,
+	/** Buffers in one pwritev(), IOV_MAX on Linux. */
+	KWAY_MERGE_IOV_MAX = 1024,
+	/**
+	 * Most numbers one range of the parallel merge keeps as text
+	 * in memory, up to (FORMAT_INT_MAX + 1) bytes each.
+	 */
+	KWAY_MERGE_PART_MAX = 1024 * 1024,
+};
+
+int number_writer_create(struct number_writer* writer, int fd, bool is_binary){
+	writer->fd = fd;
+	writer->offset = -1;
+	writer->is_binary = is_binary;
+	writer->is_fixed_width = false;
+	writer->size = 0;
+	writer->capacity = NUMBER_WRITER_BUFFER_SIZE;
+	writer->is_buffer_owned = true;
+	writer->is_failed = 0;
+	writer->mark = coro_alloc_mark();
+	writer->buffer = coro_alloc(writer->capacity);
+	return writer->buffer == NULL ? -1 : 0;
+}
+
+void number_writer_create_memory(struct number_writer* writer, char* buffer, size_t capacity){
+	writer->fd = -1;
+	writer->offset = -1;
+	writer->is_binary = false;
+	writer->is_fixed_width = false;
+	writer->size = 0;
+	writer->capacity = capacity;
+	writer->is_buffer_owned = false;
+	writer->is_failed = 0;
+	writer->buffer = buffer;
+}
+
+int number_writer_flush(struct number_writer* writer){
+	if (writer->fd < 0)
+		return 0;
+	const char* pos = writer->buffer;
+	const char* end = pos + writer->size;
+	writer->size = 0;
+	while (pos < end && !writer->is_failed){
+		ssize_t rc;
+		if (writer->offset < 0)
+			rc = coro_write(writer->fd, pos, end - pos);
+		else
+			rc = coro_pwrite(writer->fd, pos, end - pos, writer->offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0){
+			writer->is_failed = 1;
+			break;
+		}
+		pos += rc;
+		if (writer->offset >= 0)
+			writer->offset += rc;
+	}
+	return writer->is_failed ? -1 : 0;
+}
+
+int number_writer_destroy(struct number_writer* writer){
+	int rc = number_writer_flush(writer);
+	if (writer->is_buffer_owned)
+		coro_alloc_rewind(writer->mark);
+	writer->buffer = NULL;
+	return rc;
+}
+
+static inline void number_writer_put(struct number_writer* writer, int value){
+	if (writer->capacity - writer->size < FORMAT_INT_MAX + 1)
+		number_writer_flush(writer);
+	char* pos = writer->buffer + writer->size;
+	if (writer->is_binary){
+		memcpy(pos, &value, sizeof(value));
+		writer->size += sizeof(value);
+		return;
+	}
+	if (writer->is_fixed_width){
+		char text[FORMAT_INT_MAX];
+		size_t len = format_int(value, text);
+		memset(pos, ' ', NUMBER_FIXED_WIDTH);
+		memcpy(pos + NUMBER_FIXED_WIDTH - 1 - len, text, len);
+		writer->size += NUMBER_FIXED_WIDTH;
+		return;
+	}
+	size_t len = format_int(value, pos);
+	pos[len] = ' ';
+	writer->size += len + 1;
+}
+
+/**
+ * Make sure the source has an int at pos, unless it is over.
+ * Returns false on a refill error.
+ */
+static bool source_prepare(struct merge_source* source){
+	while (source->pos == source->end && source->refill != NULL){
+		int rc = source->refill(source);
+		if (rc < 0)
+			return false;
+		if (rc == 0){
+			source->refill = NULL;
+			source->pos = source->end;
+		}
+	}
+	return true;
+}
+
+/**
+ * Loser tree over the sources. Nodes 1..count-1 are inner ones and
+ * keep the loser of the match played there, the leaves are implicit
+ * at count..2*count-1. An exhausted source loses to everything.
+ */
+struct loser_tree {
+	struct merge_source* sources;
+	int count;
+	int* losers;
+};
+
+static inline bool source_less(struct merge_source* sources, int a, int b){
+	struct merge_source* sa = &sources[a];
+	struct merge_source* sb = &sources[b];
+	if (sa->pos == sa->end)
+		return false;
+	if (sb->pos == sb->end)
+		return true;
+	if (*sa->pos != *sb->pos)
+		return *sa->pos < *sb->pos;
+	return a < b;
+}
+
+/** Play all the matches under @a node, return the winner. */
+static int loser_tree_build(struct loser_tree* tree, int node){
+	if (node >= tree->count)
+		return node - tree->count;
+	int left = loser_tree_build(tree, node * 2);
+	int right = loser_tree_build(tree, node * 2 + 1);
+	if (source_less(tree->sources, left, right)){
+		tree->losers[node] = right;
+		return left;
+	}
+	tree->losers[node] = left;
+	return right;
+}
+
+/** Replay the matches on the path of a changed leaf. */
+static inline int loser_tree_replay(struct loser_tree* tree, int winner){
+	for (int node = (winner + tree->count) / 2; node > 0; node /= 2){
+		int loser = tree->losers[node];
+		if (source_less(tree->sources, loser, winner)){
+			tree->losers[node] = winner;
+			winner = loser;
+		}
+	}
+	return winner;
+}
+
+int kway_merge(struct merge_source* sources, int count, struct number_writer* writer){
+	if (count <= 0)
+		return 0;
+	for (int i = 0; i < count; ++i){
+		if (!source_prepare(&sources[i]))
+			return -1;
+	}
+
+	struct coro_alloc_mark mark = coro_alloc_mark();
+	struct loser_tree tree = {sources, count, coro_alloc(count * sizeof(int))};
+	if (tree.losers == NULL)
+		return -1;
+	int winner = loser_tree_build(&tree, 1);
+	int rc = 0;
+	unsigned step = 0;
+
+	while (true){
+		struct merge_source* source = &sources[winner];
+		/* The winner is over only when all of them are. */
+		if (source->pos == source->end)
+			break;
+		number_writer_put(writer, *source->pos++);
+		if (!source_prepare(source)){
+			rc = -1;
+			break;
+		}
+		winner = loser_tree_replay(&tree, winner);
+		if (++step % KWAY_MERGE_YIELD_STEP == 0)
+			coro_yield_if_due();
+	}
+
+	coro_alloc_rewind(mark);
+	if (writer->is_failed)
+		rc = -1;
+	return rc;
+}
+
+/** Index of the first int in [begin, end) which is > @a value. */
+static size_t upper_bound(const int* begin, const int* end, long long value){
+	size_t lo = 0, hi = end - begin;
+	while (lo < hi){
+		size_t mid = lo + (hi - lo) / 2;
+		if (begin[mid] <= value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Find where the first @a rank ints of the merged output end in
+ * each source. Equal ints on the border are taken from the first
+ * sources first.
+ */
+static void merge_path_split(struct merge_source* sources, int count, size_t rank, size_t* split){
+	/* The smallest value such that at least rank ints are <= it. */
+	long long lo = (long long)INT_MIN - 1, hi = INT_MAX;
+	while (hi - lo > 1){
+		long long mid = lo + (hi - lo) / 2;
+		size_t total = 0;
+		for (int i = 0; i < count; ++i)
+			total += upper_bound(sources[i].pos, sources[i].end, mid);
+		if (total >= rank)
+			hi = mid;
+		else
+			lo = mid;
+	}
+	size_t rest = rank;
+	for (int i = 0; i < count; ++i){
+		split[i] = upper_bound(sources[i].pos, sources[i].end, hi - 1);
+		rest -= split[i];
+	}
+	for (int i = 0; i < count && rest > 0; ++i){
+		size_t equal = upper_bound(sources[i].pos, sources[i].end, hi) - split[i];
+		size_t take = equal < rest ? equal : rest;
+		split[i] += take;
+		rest -= take;
+	}
+}
+
+/** One range of the parallel merge. */
+struct merge_part {
+	struct merge_source* sources;
+	int count;
+	/** Where the range begins in the output, in numbers. */
+	size_t rank;
+	size_t size;
+	int fd;
+	bool is_fixed_width;
+	/**
+	 * The text, when not in the fixed-width mode. It is in the
+	 * arena of the coroutine, so the coroutine is deleted only
+	 * after the text is written.
+	 */
+	char* text;
+	size_t text_size;
+	struct coro* coro;
+	int rc;
+};
+
+static int merge_part_f(void* arg){
+	struct merge_part* part = arg;
+	struct number_writer writer;
+	if (part->is_fixed_width){
+		if (number_writer_create(&writer, part->fd, false) != 0){
+			part->rc = -1;
+			return 0;
+		}
+		writer.is_fixed_width = true;
+		writer.offset = part->rank * NUMBER_FIXED_WIDTH;
+	}
+	else {
+		size_t capacity = (part->size + 1) * (FORMAT_INT_MAX + 1);
+		part->text = coro_alloc(capacity);
+		if (part->text == NULL){
+			part->rc = -1;
+			return 0;
+		}
+		number_writer_create_memory(&writer, part->text, capacity);
+	}
+	part->rc = kway_merge(part->sources, part->count, &writer);
+	part->text_size = writer.size;
+	if (number_writer_destroy(&writer) != 0)
+		part->rc = -1;
+	return 0;
+}
+
+/** Write the ranges one after another from @a offset and move it past them. */
+static int write_parts(int fd, struct merge_part* parts, int part_count, off_t* offset){
+	struct iovec iov[KWAY_MERGE_IOV_MAX];
+	int i = 0;
+	while (i < part_count){
+		int iov_count = 0;
+		size_t size = 0;
+		for (; i < part_count && iov_count < KWAY_MERGE_IOV_MAX; ++i){
+			iov[iov_count].iov_base = parts[i].text;
+			iov[iov_count].iov_len = parts[i].text_size;
+			size += parts[i].text_size;
+			++iov_count;
+		}
+		struct iovec* pos = iov;
+		while (size > 0){
+			ssize_t rc = pwritev(fd, pos, iov_count, *offset);
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc <= 0)
+				return -1;
+			*offset += rc;
+			size -= rc;
+			/* Skip what is written, after a short write too. */
+			while (iov_count > 0 && (size_t)rc >= pos->iov_len){
+				rc -= pos->iov_len;
+				++pos;
+				--iov_count;
+			}
+			if (iov_count > 0){
+				pos->iov_base = (char*)pos->iov_base + rc;
+				pos->iov_len -= rc;
+			}
+		}
+	}
+	return 0;
+}
+
+int kway_merge_parallel(struct merge_source* sources, int count, int part_count,
+			int fd, bool is_fixed_width){
+	size_t total = 0;
+	for (int i = 0; i < count; ++i)
+		total += sources[i].end - sources[i].pos;
+	if (part_count < 1)
+		part_count = 1;
+	/*
+	 * The text is collected in memory, so it is merged in rounds
+	 * of a bounded size, each written out before the next one.
+	 */
+	size_t round_size = total;
+	if (!is_fixed_width && round_size > (size_t)part_count * KWAY_MERGE_PART_MAX)
+		round_size = (size_t)part_count * KWAY_MERGE_PART_MAX;
+	if ((size_t)part_count > round_size)
+		part_count = round_size > 0 ? round_size : 1;
+
+	int rc = -1;
+	struct coro_alloc_mark mark = coro_alloc_mark();
+	struct merge_part* parts = coro_alloc(part_count * sizeof(*parts));
+	size_t* splits = coro_alloc((size_t)(part_count + 1) * count * sizeof(size_t));
+	struct merge_source* part_sources = coro_alloc((size_t)part_count * count * sizeof(*part_sources));
+	if (parts == NULL || splits == NULL || (count > 0 && part_sources == NULL))
+		goto out;
+	/* The arena does not zero, and an empty part never sets refill. */
+	memset(splits, 0, (size_t)count * sizeof(size_t));
+	memset(part_sources, 0, (size_t)part_count * count * sizeof(*part_sources));
+
+	rc = 0;
+	off_t offset = 0;
+	size_t round_begin = 0;
+	while (rc == 0 && round_begin < total){
+		size_t round = total - round_begin < round_size ? total - round_begin : round_size;
+		memset(parts, 0, part_count * sizeof(*parts));
+		/* The first split is where the previous round ended. */
+		for (int p = 1; p <= part_count; ++p)
+			merge_path_split(sources, count, round_begin + round * p / part_count, splits + (size_t)p * count);
+		for (int p = 0; p < part_count; ++p){
+			struct merge_part* part = &parts[p];
+			part->sources = part_sources + (size_t)p * count;
+			part->count = count;
+			part->rank = round_begin + round * p / part_count;
+			part->size = round_begin + round * (p + 1) / part_count - part->rank;
+			part->fd = fd;
+			part->is_fixed_width = is_fixed_width;
+			size_t* begin = splits + (size_t)p * count;
+			size_t* end = begin + count;
+			for (int i = 0; i < count; ++i){
+				part->sources[i].pos = sources[i].pos + begin[i];
+				part->sources[i].end = sources[i].pos + end[i];
+			}
+			part->coro = coro_new(merge_part_f, part);
+		}
+		while (coro_sched_wait() != NULL)
+			;
+
+		for (int p = 0; p < part_count; ++p){
+			if (parts[p].rc != 0)
+				rc = -1;
+		}
+		if (rc == 0 && !is_fixed_width)
+			rc = write_parts(fd, parts, part_count, &offset);
+
+		/* Their arenas hold the text of the round. */
+		for (int p = 0; p < part_count; ++p)
+			coro_delete(parts[p].coro);
+		memcpy(splits, splits + (size_t)part_count * count, (size_t)count * sizeof(size_t));
+		round_begin += round;
+	}
+
+out:
+	coro_alloc_rewind(mark);
+	return rc;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "libcoro.h"
+
+/**
+ * A sorted stream of ints. Ints in [pos, end) are available right
+ * away. When they run out, refill() is called to get more, if it
+ * is set.
+ */
+struct merge_source {
+	const int* pos;
+	const int* end;
+	/**
+	 * Make the next ints available in [pos, end). Returns their
+	 * count, 0 at the end of the stream, -1 on error.
+	 */
+	int (*refill)(struct merge_source* source);
+	/** Anything the refill function needs. */
+	void* ctx;
+};
+
+enum {
+	/**
+	 * Size of a number in the fixed-width text: right-aligned
+	 * in the width of the longest int, and a space.
+	 */
+	NUMBER_FIXED_WIDTH = 12,
+	/** Output is flushed by chunks of this size. */
+	NUMBER_WRITER_BUFFER_SIZE = 1024 * 1024,
+};
+
+/**
+ * Buffered output of ints as text, each followed by a space, or
+ * as raw binary ints. Written via coro_write(), or via
+ * coro_pwrite() from the given offset. Can also just collect the
+ * output in memory.
+ */
+struct number_writer {
+	/** -1 if the output stays in the buffer. */
+	int fd;
+	/** Where the next flush goes. -1 is the current file position. */
+	off_t offset;
+	bool is_binary;
+	/** Each number takes NUMBER_FIXED_WIDTH chars. */
+	bool is_fixed_width;
+	char* buffer;
+	size_t size;
+	size_t capacity;
+	bool is_buffer_owned;
+	/** Arena position to release the own buffer. */
+	struct coro_alloc_mark mark;
+	/** Set if a write() failed, further output is dropped. */
+	int is_failed;
+};
+
+/**
+ * Start writing to @a fd. The offset and fixed width can be set in
+ * the writer right after. The buffer is taken from the arena of
+ * the current coroutine, so the writer must be destroyed before
+ * anything allocated earlier is released. Returns 0 on success,
+ * -1 on error.
+ */
+int number_writer_create(struct number_writer* writer, int fd, bool is_binary);
+
+/**
+ * Collect text in @a buffer of @a capacity bytes. It must fit all
+ * the numbers, (FORMAT_INT_MAX + 1) bytes each, and one more.
+ */
+void number_writer_create_memory(struct number_writer* writer, char* buffer, size_t capacity);
+
+/**
+ * Flush the rest and release the buffer along with everything
+ * allocated in the arena after it. Returns -1 if any write failed.
+ */
+int number_writer_destroy(struct number_writer* writer);
+
+/** Write the buffered text out. Returns -1 on error. */
+int number_writer_flush(struct number_writer* writer);
+
+/**
+ * Merge @a count sorted sources into @a writer with a loser tree,
+ * log2(count) comparisons per int. Returns 0 on success, -1 if a
+ * source failed to refill or the output failed.
+ */
+int kway_merge(struct merge_source* sources, int count, struct number_writer* writer);
+
+/**
+ * Merge @a count sorted in-memory sources (without refill) into
+ * @a fd by @a part_count coroutines. The output is split into
+ * equal ranges by merge path: for each range boundary the split
+ * points in all the sources are found by a binary search on the
+ * value. Each coroutine merges its range on its own.
+ *
+ * In the fixed-width mode the offsets of the ranges are known
+ * in advance, and each coroutine writes its range itself. Else
+ * the ranges are collected in memory and written by pwritev() at
+ * offsets found when all are done. To bound the memory, the text
+ * is merged in rounds of up to about 1M numbers per coroutine,
+ * and each round is written out before the next one starts.
+ *
+ * Must be called outside of coroutines. Returns 0 on success, -1
+ * on error.
+ */
+int kway_merge_parallel(struct merge_source* sources, int count, int part_count,
+			int fd, bool is_fixed_width);
@@ -1,76 +1,1026 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <setjmp.h>
-#include <signal.h>
+#include <stdint.h>
+#include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
 #include "libcoro.h"
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+/*
+ * Context switch backend is chosen at build time. By default a
+ * hand-written swap of the callee-saved registers is used on
+ * x86-64 and aarch64. Anywhere else, or when CORO_CTX_UCONTEXT is
+ * defined, the portable but slower ucontext is used - it does a
+ * sigprocmask() syscall on each switch.
+ */
+#if !defined(CORO_CTX_UCONTEXT) && !defined(CORO_CTX_ASM)
+#if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_CTX_ASM
+#else
+#define CORO_CTX_UCONTEXT
+#endif
+#endif
+
+#ifdef CORO_CTX_UCONTEXT
+#include <ucontext.h>
+#endif
+
+#ifdef CORO_CTX_ASM
+
+/**
+ * Saved execution context. All the callee-saved registers are
+ * pushed onto the coroutine's own stack right before a switch,
+ * so only the stack pointer has to be remembered.
+ */
+struct coro_ctx {
+	void *sp;
+};
+
+/**
+ * Save callee-saved registers of the current context on its
+ * stack, store the stack pointer into @a from_sp, load @a to_sp
+ * and restore the registers saved there. Returns into the target
+ * context.
+ */
+void
+coro_ctx_swap(void **from_sp, void *to_sp);
+
+/**
+ * First instruction of each new coroutine. Calls the function
+ * from a callee-saved register, which was put there by
+ * coro_ctx_make(). The function never returns.
+ */
+void
+coro_ctx_trampoline(void);
+
+#if defined(__x86_64__)
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".type coro_ctx_swap,@function\n"
+	"coro_ctx_swap:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coro_ctx_swap,.-coro_ctx_swap\n"
+	".p2align 4\n"
+	".type coro_ctx_trampoline,@function\n"
+	"coro_ctx_trampoline:\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size coro_ctx_trampoline,.-coro_ctx_trampoline\n"
+);
+
+/** Registers popped by coro_ctx_swap(): r15-r12, rbx, rbp. */
+enum { CORO_CTX_SAVED_REGS = 6 };
+
+static void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void))
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	/*
+	 * Slots: the saved registers, then the return address of
+	 * coro_ctx_swap(). One more slot of padding makes the stack
+	 * 16-byte aligned right after 'ret', as the ABI requires
+	 * before the trampoline's 'call'.
+	 */
+	uintptr_t *sp = (uintptr_t *)top - (CORO_CTX_SAVED_REGS + 3);
+	memset(sp, 0, (CORO_CTX_SAVED_REGS + 3) * sizeof(*sp));
+	/* r12 is the 4th popped register. */
+	sp[3] = (uintptr_t)entry;
+	sp[CORO_CTX_SAVED_REGS] = (uintptr_t)coro_ctx_trampoline;
+	ctx->sp = sp;
+}
+
+#elif defined(__aarch64__)
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".type coro_ctx_swap,%function\n"
+	"coro_ctx_swap:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x2, sp\n"
+	"	str x2, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size coro_ctx_swap,.-coro_ctx_swap\n"
+	".p2align 4\n"
+	".type coro_ctx_trampoline,%function\n"
+	"coro_ctx_trampoline:\n"
+	"	blr x19\n"
+	"	brk #0\n"
+	".size coro_ctx_trampoline,.-coro_ctx_trampoline\n"
+);
+
+/** Bytes stored by coro_ctx_swap(): x19-x30 and d8-d15. */
+enum { CORO_CTX_FRAME_SIZE = 160 };
+
+static void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void))
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	uintptr_t *sp = (uintptr_t *)(top - CORO_CTX_FRAME_SIZE);
+	memset(sp, 0, CORO_CTX_FRAME_SIZE);
+	/* x19 keeps the entry, x30 (lr) is where 'ret' goes. */
+	sp[0] = (uintptr_t)entry;
+	sp[11] = (uintptr_t)coro_ctx_trampoline;
+	ctx->sp = sp;
+}
+
+#endif
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	coro_ctx_swap(&from->sp, to->sp);
+}
+
+#else /* CORO_CTX_UCONTEXT */
+
+struct coro_ctx {
+	ucontext_t uc;
+};
+
+static void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void))
+{
+	if (getcontext(&ctx->uc) != 0)
+		handle_error();
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = stack_size;
+	ctx->uc.uc_link = NULL;
+	makecontext(&ctx->uc, entry, 0);
+}
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (swapcontext(&from->uc, &to->uc) != 0)
+		handle_error();
+}
+
+#endif
+
+const char *
+coro_backend_name(void)
+{
+#ifdef CORO_CTX_ASM
+#if defined(__x86_64__)
+	return "asm-x86_64";
+#else
+	return "asm-aarch64";
+#endif
+#else
+	return "ucontext";
+#endif
+}
+
+enum {
+	/** Stack size when no attributes are given. */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** How many free stacks the pool keeps for reuse. */
+	CORO_STACK_POOL_MAX = 64,
+};
+
+/**
+ * Coroutine stack. It is a separate mapping with a PROT_NONE
+ * guard page at the bottom, so an overflow faults immediately
+ * instead of corrupting neighbour memory. The descriptor lives
+ * in the mapping itself, above the usable area.
+ *
+ * The guard can be turned off. Each guard splits the stack into
+ * two kernel memory areas, and their count per process is
+ * limited (vm.max_map_count), which matters for 100k+ stacks.
+ */
+struct coro_stack {
+	/** Begin of the whole mapping including the guard page. */
+	void *map;
+	/** Size of the whole mapping. */
+	size_t map_size;
+	/** Usable size from the guard page to the descriptor. */
+	size_t size;
+	bool is_guarded;
+	/** Next free stack in the pool. */
+	struct coro_stack *next;
+};
+
+/** Free stacks ready for reuse, the latest freed first. */
+struct coro_stack_pool {
+	struct coro_stack *head;
+	int size;
+	size_t page_size;
+	/** Protects the pool, workers create and delete coroutines too. */
+	pthread_mutex_t mutex;
+	/**
+	 * Stack tops are all at the same offset inside a page, so hot
+	 * frames of different coroutines compete for the same cache
+	 * sets. Each new coroutine starts a bit lower than the previous
+	 * one to spread them.
+	 */
+	atomic_uint color;
+};
+
+enum {
+	CORO_STACK_COLOR_STEP = 128,
+	CORO_STACK_COLOR_COUNT = 32,
+};
+
+static void
+coro_stack_pool_create(struct coro_stack_pool *pool)
+{
+	pool->head = NULL;
+	pool->size = 0;
+	pool->page_size = sysconf(_SC_PAGESIZE);
+	pthread_mutex_init(&pool->mutex, NULL);
+	atomic_init(&pool->color, 0);
+}
+
+static size_t
+coro_round_to_page(const struct coro_stack_pool *pool, size_t size)
+{
+	return (size + pool->page_size - 1) & ~(pool->page_size - 1);
+}
+
+/**
+ * Take a stack with exactly @a size usable bytes from the pool,
+ * or map a new one. The most recently freed stacks are tried
+ * first - their pages are likely still hot.
+ */
+static struct coro_stack *
+coro_stack_new(struct coro_stack_pool *pool, size_t size, bool is_guarded)
+{
+	size = coro_round_to_page(pool, size + sizeof(struct coro_stack)) -
+	       sizeof(struct coro_stack);
+	pthread_mutex_lock(&pool->mutex);
+	struct coro_stack **prev = &pool->head;
+	for (struct coro_stack *s = pool->head; s != NULL;
+	     prev = &s->next, s = s->next) {
+		if (s->size == size && s->is_guarded == is_guarded) {
+			*prev = s->next;
+			--pool->size;
+			pthread_mutex_unlock(&pool->mutex);
+			return s;
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	size_t guard_size = is_guarded ? pool->page_size : 0;
+	size_t map_size = guard_size + size + sizeof(struct coro_stack);
+	char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	if (is_guarded && mprotect(map, guard_size, PROT_NONE) != 0)
+		handle_error();
+	struct coro_stack *s = (struct coro_stack *)(map + map_size) - 1;
+	s->map = map;
+	s->map_size = map_size;
+	s->size = size;
+	s->is_guarded = is_guarded;
+	s->next = NULL;
+	return s;
+}
+
+/** Bottom of the usable stack area, right above the guard. */
+static inline void *
+coro_stack_begin(const struct coro_stack *s)
+{
+	return (char *)s - s->size;
+}
+
+/** Return a stack into the pool, or unmap it if the pool is full. */
+static void
+coro_stack_delete(struct coro_stack_pool *pool, struct coro_stack *s)
+{
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->size < CORO_STACK_POOL_MAX) {
+		s->next = pool->head;
+		pool->head = s;
+		++pool->size;
+		pthread_mutex_unlock(&pool->mutex);
+		return;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	if (munmap(s->map, s->map_size) != 0)
+		handle_error();
+}
+
+/** Unmap all the cached stacks. */
+static void
+coro_stack_pool_destroy(struct coro_stack_pool *pool)
+{
+	struct coro_stack *s = pool->head;
+	while (s != NULL) {
+		struct coro_stack *next = s->next;
+		if (munmap(s->map, s->map_size) != 0)
+			handle_error();
+		s = next;
+	}
+	pool->head = NULL;
+	pool->size = 0;
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+/*
+ * Time slicing. The clock is the CPU's invariant timestamp counter
+ * when there is one, converted to nanoseconds by a factor measured
+ * against CLOCK_MONOTONIC when the scheduler is created. Elsewhere it
+ * is vDSO clock_gettime() in nanoseconds.
+ */
+
+enum {
+	/** Time slice when none is given in coro_attr. */
+	CORO_TIME_SLICE_DEFAULT_NS = 1000000,
+	/** How long the counter is measured against the clock. */
+	CORO_CLOCK_CALIBRATION_NS = 1000000,
+	/** Histogram bucket bits per power of 2. */
+	CORO_HIST_SUB_BITS = 3,
+	CORO_HIST_SUB_COUNT = 1 << CORO_HIST_SUB_BITS,
+	CORO_HIST_SIZE = (64 - CORO_HIST_SUB_BITS + 1) * CORO_HIST_SUB_COUNT,
+};
+
+struct coro_clock {
+	bool is_tsc;
+	double ns_per_tick;
+};
+
+static inline uint64_t
+coro_clock_monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+coro_clock_ticks(const struct coro_clock *clock)
+{
+	(void)clock;
+#if defined(__x86_64__)
+	if (clock->is_tsc)
+		return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#endif
+	return coro_clock_monotonic_ns();
+}
+
+static void
+coro_clock_create(struct coro_clock *clock)
+{
+	clock->is_tsc = false;
+	clock->ns_per_tick = 1;
+#if defined(__x86_64__)
+	unsigned eax, ebx, ecx, edx;
+	/* Invariant TSC: constant rate in all power states. */
+	clock->is_tsc = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) &&
+			(edx & (1 << 8)) != 0;
+	if (!clock->is_tsc)
+		return;
+	uint64_t ns_begin = coro_clock_monotonic_ns();
+	uint64_t ticks_begin = __builtin_ia32_rdtsc();
+	uint64_t ns_end;
+	while ((ns_end = coro_clock_monotonic_ns()) - ns_begin <
+	       CORO_CLOCK_CALIBRATION_NS)
+		;
+	uint64_t ticks_end = __builtin_ia32_rdtsc();
+	clock->ns_per_tick =
+		(double)(ns_end - ns_begin) / (ticks_end - ticks_begin);
+#elif defined(__aarch64__)
+	uint64_t freq;
+	__asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+	clock->ns_per_tick = 1e9 / freq;
+#endif
+}
+
+static inline uint64_t
+coro_clock_to_ns(const struct coro_clock *clock, uint64_t ticks)
+{
+	return ticks * clock->ns_per_tick;
+}
+
+static inline uint64_t
+coro_clock_from_ns(const struct coro_clock *clock, uint64_t ns)
+{
+	return ns / clock->ns_per_tick;
+}
+
+/**
+ * Histogram of durations in clock ticks. Buckets are exact below
+ * CORO_HIST_SUB_COUNT, and then each power of 2 is split into
+ * CORO_HIST_SUB_COUNT buckets, so the error is within 1/8.
+ */
+struct coro_hist {
+	uint64_t buckets[CORO_HIST_SIZE];
+	uint64_t count;
+	uint64_t max;
+};
+
+static inline int
+coro_hist_bucket(uint64_t value)
+{
+	if (value < CORO_HIST_SUB_COUNT)
+		return value;
+	int exp = 63 - __builtin_clzll(value);
+	int sub = (value >> (exp - CORO_HIST_SUB_BITS)) &
+		  (CORO_HIST_SUB_COUNT - 1);
+	return (exp - CORO_HIST_SUB_BITS + 1) * CORO_HIST_SUB_COUNT + sub;
+}
+
+/** The biggest value falling into the bucket. */
+static uint64_t
+coro_hist_bucket_max(int bucket)
+{
+	if (bucket < CORO_HIST_SUB_COUNT)
+		return bucket;
+	int exp = bucket / CORO_HIST_SUB_COUNT + CORO_HIST_SUB_BITS - 1;
+	uint64_t sub = bucket % CORO_HIST_SUB_COUNT;
+	uint64_t step = 1ULL << (exp - CORO_HIST_SUB_BITS);
+	return (1ULL << exp) + (sub + 1) * step - 1;
+}
+
+static inline void
+coro_hist_add(struct coro_hist *h, uint64_t value)
+{
+	++h->buckets[coro_hist_bucket(value)];
+	++h->count;
+	if (value > h->max)
+		h->max = value;
+}
+
+static void
+coro_hist_merge(struct coro_hist *dst, const struct coro_hist *src)
+{
+	for (int i = 0; i < CORO_HIST_SIZE; ++i)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/** Value at the @a percent, in nanoseconds. */
+static uint64_t
+coro_hist_percentile_ns(const struct coro_hist *h, double percent,
+			const struct coro_clock *clock)
+{
+	if (h->count == 0)
+		return 0;
+	uint64_t rank = h->count * percent / 100;
+	if (rank >= h->count)
+		rank = h->count - 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < CORO_HIST_SIZE; ++i) {
+		seen += h->buckets[i];
+		if (seen > rank) {
+			uint64_t value = coro_hist_bucket_max(i);
+			return coro_clock_to_ns(clock, value < h->max ?
+							      value : h->max);
+		}
+	}
+	return coro_clock_to_ns(clock, h->max);
+}
+
+/*
+ * Each coroutine has an arena for the memory it needs while it
+ * works. The memory is bumped off big chunks and is never freed
+ * piece by piece - all of it goes away at once when the coroutine
+ * is deleted, or back to a mark taken earlier.
+ */
+
+enum {
+	/** Size of the first chunk of an arena. */
+	CORO_ARENA_CHUNK_MIN = 64 * 1024,
+	/** Chunks grow twice each time until this size. */
+	CORO_ARENA_CHUNK_MAX = 16 * 1024 * 1024,
+	/** Alignment of each allocation. */
+	CORO_ARENA_ALIGN = 16,
+};
+
+struct coro_arena_chunk {
+	/** The chunk allocated before this one. */
+	struct coro_arena_chunk *prev;
+	/** Bytes after the header. */
+	size_t size;
+	/** Bytes given away. */
+	size_t used;
+} __attribute__((aligned(CORO_ARENA_ALIGN)));
+
+struct coro_arena {
+	/** The chunk allocations come from. */
+	struct coro_arena_chunk *top;
+	/**
+	 * The biggest chunk released by a rewind. It is kept for
+	 * the next growth, so a loop taking a mark and rewinding to
+	 * it does not call malloc() each time.
+	 */
+	struct coro_arena_chunk *spare;
+	/** Size of the next chunk to allocate. */
+	size_t next_size;
+};
+
+static inline char *
+coro_arena_chunk_data(struct coro_arena_chunk *chunk)
+{
+	return (char *)(chunk + 1);
+}
+
+static void
+coro_arena_release(struct coro_arena *a, struct coro_arena_chunk *chunk)
+{
+	if (a->spare == NULL || chunk->size > a->spare->size) {
+		free(a->spare);
+		a->spare = chunk;
+	} else {
+		free(chunk);
+	}
+}
+
+static void *
+coro_arena_alloc(struct coro_arena *a, size_t size)
+{
+	if (size > SIZE_MAX - CORO_ARENA_ALIGN)
+		return NULL;
+	size = (size + CORO_ARENA_ALIGN - 1) & ~(size_t)(CORO_ARENA_ALIGN - 1);
+	struct coro_arena_chunk *top = a->top;
+	if (top != NULL && top->size - top->used >= size) {
+		char *ptr = coro_arena_chunk_data(top) + top->used;
+		top->used += size;
+		return ptr;
+	}
+	struct coro_arena_chunk *chunk;
+	if (a->spare != NULL && a->spare->size >= size) {
+		chunk = a->spare;
+		a->spare = NULL;
+	} else {
+		if (a->next_size == 0)
+			a->next_size = CORO_ARENA_CHUNK_MIN;
+		size_t chunk_size = a->next_size;
+		if (chunk_size < size)
+			chunk_size = size;
+		else if (a->next_size < CORO_ARENA_CHUNK_MAX)
+			a->next_size *= 2;
+		if (chunk_size > SIZE_MAX - sizeof(*chunk))
+			return NULL;
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->size = chunk_size;
+	}
+	/* The rest of the old top is lost until a rewind. */
+	chunk->prev = top;
+	chunk->used = size;
+	a->top = chunk;
+	return coro_arena_chunk_data(chunk);
+}
+
+static void *
+coro_arena_grow(struct coro_arena *a, void *ptr, size_t old_size,
+		size_t new_size)
+{
+	if (ptr == NULL)
+		return coro_arena_alloc(a, new_size);
+	struct coro_arena_chunk *top = a->top;
+	size_t align = CORO_ARENA_ALIGN - 1;
+	size_t old_end = (old_size + align) & ~align;
+	char *data = top != NULL ? coro_arena_chunk_data(top) : NULL;
+	if (data != NULL && (char *)ptr >= data &&
+	    (char *)ptr + old_end == data + top->used &&
+	    new_size <= top->size - ((char *)ptr - data)) {
+		/* The last allocation - just move the bump pointer. */
+		size_t new_end = (new_size + align) & ~align;
+		top->used = (char *)ptr - data + new_end;
+		return ptr;
+	}
+	if (data != NULL && ptr == data && top->used == old_end) {
+		/*
+		 * The only allocation in the chunk, which is the case
+		 * for big arrays growing geometrically. Realloc can
+		 * often extend the chunk without a copy.
+		 */
+		size_t new_end = (new_size + align) & ~align;
+		if (new_end < new_size || new_end > SIZE_MAX - sizeof(*top))
+			return NULL;
+		top = realloc(top, sizeof(*top) + new_end);
+		if (top == NULL)
+			return NULL;
+		top->size = new_end;
+		top->used = new_end;
+		a->top = top;
+		return coro_arena_chunk_data(top);
+	}
+	void *res = coro_arena_alloc(a, new_size);
+	if (res != NULL)
+		memcpy(res, ptr, old_size < new_size ? old_size : new_size);
+	return res;
+}
+
+static void
+coro_arena_rewind(struct coro_arena *a, struct coro_alloc_mark mark)
+{
+	while (a->top != mark.chunk) {
+		struct coro_arena_chunk *chunk = a->top;
+		assert(chunk != NULL);
+		a->top = chunk->prev;
+		coro_arena_release(a, chunk);
+	}
+	if (a->top != NULL)
+		a->top->used = mark.used;
+}
+
+static void *
+coro_arena_rewind_keep(struct coro_arena *a, struct coro_alloc_mark mark,
+		       void *ptr, size_t size)
+{
+	struct coro_arena_chunk *top = a->top;
+	size_t end = (size + CORO_ARENA_ALIGN - 1) &
+		     ~(size_t)(CORO_ARENA_ALIGN - 1);
+	if (top == mark.chunk) {
+		char *dst = coro_arena_chunk_data(top) + mark.used;
+		memmove(dst, ptr, size);
+		top->used = mark.used + end;
+		return dst;
+	}
+	/* Keep the top chunk with only @a ptr, drop the others. */
+	memmove(coro_arena_chunk_data(top), ptr, size);
+	top->used = end;
+	a->top = top->prev;
+	coro_arena_rewind(a, mark);
+	top->prev = a->top;
+	a->top = top;
+	return coro_arena_chunk_data(top);
+}
+
+static void
+coro_arena_destroy(struct coro_arena *a)
+{
+	struct coro_alloc_mark empty = {NULL, 0};
+	coro_arena_rewind(a, empty);
+	free(a->spare);
+	memset(a, 0, sizeof(*a));
+}
+
+enum coro_state {
+	/** Waits in a ready queue. */
+	CORO_STATE_READY,
+	/** Works right now. */
+	CORO_STATE_RUNNING,
+	/**
+	 * Called coro_suspend() and is switching out. Its context
+	 * is not saved yet, so it can't be resumed by anybody.
+	 */
+	CORO_STATE_PARKING,
+	/** Blocked in coro_suspend() until coro_wakeup(). */
+	CORO_STATE_SUSPENDED,
+	/** Returned from its function, waits for coro_delete(). */
+	CORO_STATE_FINISHED,
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
 	/** Stack, used by the coroutine. */
-	void *stack;
+	struct coro_stack *stack;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
 	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
-	/** True, if the coroutine has finished. */
-	bool is_finished;
+	struct coro_ctx ctx;
+	/** enum coro_state. Changed by wakeups from any thread. */
+	atomic_int state;
+	/**
+	 * Set by coro_wakeup() which came while the coroutine was
+	 * not suspended yet. The next coro_suspend() returns
+	 * immediately then.
+	 */
+	atomic_bool is_wakeup_pending;
+	/** Worker which ran the coroutine last time. */
+	struct coro_worker *worker;
+	/** Runtime of the scheduler the coroutine belongs to. */
+	struct coro_rt *rt;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
-	struct coro *next, *prev;
+	/** Clock ticks when the coroutine was switched in. */
+	uint64_t slice_begin;
+	/** Time slice length in clock ticks. */
+	uint64_t slice_ticks;
+	/** Total time the coroutine was running, in clock ticks. */
+	uint64_t run_ticks;
+	/** Memory given by coro_alloc(). */
+	struct coro_arena arena;
+	/** Link in a ready or the finished queue. */
+	struct coro *next;
+};
+
+/** Intrusive FIFO of coroutines. */
+struct coro_queue {
+	struct coro *head;
+	struct coro *tail;
 };
 
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	if (q->head == NULL)
+		q->head = c;
+	else
+		q->tail->next = c;
+	q->tail = c;
+}
+
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->head;
+	if (c != NULL)
+		q->head = c->next;
+	return c;
+}
+
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * A thread running coroutines. In the single-threaded mode the
+ * only worker is the thread calling coro_sched_wait(). In the
+ * multithreaded mode there are N worker threads, and each takes
+ * coroutines from its own queue first and steals from the others
+ * when the own one is empty.
  */
-static struct coro coro_sched;
+struct coro_worker {
+	/**
+	 * Scheduler is a main coroutine of the worker. It picks
+	 * the next coroutine when the current one can't continue.
+	 */
+	struct coro sched;
+	/** Coroutines ready to run on this worker. */
+	struct coro_queue ready;
+	/**
+	 * Coroutines woken up by other threads in the
+	 * single-threaded mode, to be moved into the ready queue.
+	 */
+	struct coro_queue inbox;
+	atomic_bool has_inbox;
+	/** Protects the ready queue or, in one thread, the inbox. */
+	pthread_mutex_t mutex;
+	/** Signaled when the inbox gets a coroutine. */
+	pthread_cond_t inbox_cond;
+	/**
+	 * Coroutine which has just switched out. It is put into a
+	 * queue by whoever gets the control next, when its context
+	 * is already saved and it is safe to resume it elsewhere.
+	 */
+	struct coro *prev;
+	/** Lengths of the slices run by coroutines on this worker. */
+	struct coro_hist slices;
+	/** How much longer than their time slices they were. */
+	struct coro_hist overruns;
+	struct coro_rt *rt;
+	pthread_t thread;
+};
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * All the scheduler state shared by the workers. It is created by
+ * coro_sched_init() and each coroutine points at it, so the library
+ * keeps only the thread-local pointers to the current coroutine and
+ * worker.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
-/**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+struct coro_rt {
+	struct coro_worker *workers;
+	int worker_count;
+	/** True if the workers are separate threads. */
+	bool is_mt;
+	/** Round-robin counter to spread new coroutines. */
+	atomic_uint next_worker;
+	/** Coroutines in all the ready queues. */
+	atomic_int ready_count;
+	/** Workers sleeping on idle_cond. */
+	atomic_int sleeper_count;
+	pthread_mutex_t idle_mutex;
+	pthread_cond_t idle_cond;
+	bool is_shutdown;
+	/** Created and not yet returned by coro_sched_wait(). */
+	atomic_int coro_count;
+	/**
+	 * I/O requests in progress. Their coroutines are suspended
+	 * but will be woken up by the I/O threads.
+	 */
+	atomic_int io_count;
+	/** Finished coroutines not yet returned by coro_sched_wait(). */
+	struct coro_queue finished;
+	pthread_mutex_t finished_mutex;
+	pthread_cond_t finished_cond;
+	/**
+	 * Stands for the thread which called coro_sched_init_mt(). It
+	 * is not a worker, but can use coro_alloc() as well.
+	 */
+	struct coro main_this;
+	struct coro_stack_pool stacks;
+	struct coro_clock clock;
+	/** I/O threads, started on the first request. */
+	struct coro_io *io;
+};
+
+/** Arena of threads which have no coroutines at all. */
+static __thread struct coro_arena coro_thread_arena;
+
+/** Which coroutine works at this moment in this thread. */
+static __thread struct coro *coro_this_ptr = NULL;
+/** Worker of this thread. NULL in non-worker threads. */
+static __thread struct coro_worker *coro_worker_ptr = NULL;
+
+/*
+ * A coroutine can be resumed in another thread than the one it
+ * was switched out in. The compiler does not know that, and can
+ * reuse the thread pointer loaded before a switch to access the
+ * thread-local variables after it. So any code which runs after
+ * a switch and touches them must be in a separate not inlined
+ * function, like coro_after_switch().
  */
-static sigjmp_buf start_point;
+static inline struct coro_worker *
+coro_worker_get(void)
+{
+	return coro_worker_ptr;
+}
 
-/** Add a new coroutine to the beginning of the list. */
+static inline void
+coro_this_set(struct coro *c)
+{
+	coro_this_ptr = c;
+}
+
+static inline struct coro *
+coro_this_get(void)
+{
+	return coro_this_ptr;
+}
+
+/** Runtime of the scheduler of this thread, NULL if there is none. */
+static inline struct coro_rt *
+coro_rt_get(void)
+{
+	struct coro *c = coro_this_get();
+	return c != NULL ? c->rt : NULL;
+}
+
+/**
+ * Put a ready coroutine into a worker's queue. In the
+ * single-threaded mode the queue belongs to the worker alone, and
+ * other threads can only leave coroutines in its inbox.
+ */
 static void
-coro_list_add(struct coro *c)
+coro_worker_push(struct coro_worker *w, struct coro *c)
+{
+	struct coro_rt *rt = w->rt;
+	c->worker = w;
+	if (!rt->is_mt) {
+		if (coro_worker_get() == w) {
+			coro_queue_push(&w->ready, c);
+			return;
+		}
+		pthread_mutex_lock(&w->mutex);
+		coro_queue_push(&w->inbox, c);
+		atomic_store(&w->has_inbox, true);
+		pthread_cond_signal(&w->inbox_cond);
+		pthread_mutex_unlock(&w->mutex);
+		return;
+	}
+	pthread_mutex_lock(&w->mutex);
+	coro_queue_push(&w->ready, c);
+	pthread_mutex_unlock(&w->mutex);
+	atomic_fetch_add(&rt->ready_count, 1);
+	if (atomic_load(&rt->sleeper_count) > 0) {
+		pthread_mutex_lock(&rt->idle_mutex);
+		pthread_cond_signal(&rt->idle_cond);
+		pthread_mutex_unlock(&rt->idle_mutex);
+	}
+}
+
+static struct coro *
+coro_worker_pop(struct coro_worker *w)
+{
+	struct coro_rt *rt = w->rt;
+	struct coro *c;
+	if (!rt->is_mt) {
+		if (atomic_load_explicit(&w->has_inbox,
+					 memory_order_relaxed)) {
+			pthread_mutex_lock(&w->mutex);
+			while ((c = coro_queue_pop(&w->inbox)) != NULL)
+				coro_queue_push(&w->ready, c);
+			atomic_store(&w->has_inbox, false);
+			pthread_mutex_unlock(&w->mutex);
+		}
+		return coro_queue_pop(&w->ready);
+	}
+	pthread_mutex_lock(&w->mutex);
+	c = coro_queue_pop(&w->ready);
+	pthread_mutex_unlock(&w->mutex);
+	if (c != NULL)
+		atomic_fetch_sub(&rt->ready_count, 1);
+	return c;
+}
+
+/** Take a coroutine from the own queue, or steal one. */
+static struct coro *
+coro_worker_next(struct coro_worker *w)
+{
+	struct coro_rt *rt = w->rt;
+	struct coro *c = coro_worker_pop(w);
+	if (c != NULL || atomic_load(&rt->ready_count) == 0)
+		return c;
+	int self = w - rt->workers;
+	for (int i = 1; i < rt->worker_count && c == NULL; ++i) {
+		int victim = (self + i) % rt->worker_count;
+		c = coro_worker_pop(&rt->workers[victim]);
+	}
+	return c;
+}
+
+/**
+ * Block the worker until any queue is not empty. Returns false
+ * on shutdown.
+ */
+static bool
+coro_worker_sleep(struct coro_rt *rt)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	pthread_mutex_lock(&rt->idle_mutex);
+	while (atomic_load(&rt->ready_count) == 0 &&
+	       !rt->is_shutdown) {
+		atomic_fetch_add(&rt->sleeper_count, 1);
+		/*
+		 * Pushers increment ready_count before looking at
+		 * sleeper_count, so either the check above sees
+		 * the new coroutine, or the pusher sees this sleeper.
+		 */
+		if (atomic_load(&rt->ready_count) == 0)
+			pthread_cond_wait(&rt->idle_cond,
+					  &rt->idle_mutex);
+		atomic_fetch_sub(&rt->sleeper_count, 1);
+	}
+	bool ok = !rt->is_shutdown;
+	pthread_mutex_unlock(&rt->idle_mutex);
+	return ok;
 }
 
-/** Remove a coroutine from the list. */
 static void
-coro_list_delete(struct coro *c)
+coro_finished_push(struct coro_rt *rt, struct coro *c)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	pthread_mutex_lock(&rt->finished_mutex);
+	coro_queue_push(&rt->finished, c);
+	pthread_cond_signal(&rt->finished_cond);
+	pthread_mutex_unlock(&rt->finished_mutex);
 }
 
 int
@@ -88,171 +1038,974 @@ coro_switch_count(const struct coro *c)
 bool
 coro_is_finished(const struct coro *c)
 {
-	return c->is_finished;
+	return atomic_load(&c->state) == CORO_STATE_FINISHED;
 }
 
 void
 coro_delete(struct coro *c)
 {
-	free(c->stack);
+	coro_stack_delete(&c->rt->stacks, c->stack);
+	coro_arena_destroy(&c->arena);
 	free(c);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
+/**
+ * Finish a switch on the side which got the control: put the
+ * coroutine which has just left where it belongs. Must be called
+ * after each switch, before anything else.
+ */
+static __attribute__((noinline)) void
+coro_after_switch(void)
+{
+	struct coro_worker *w = coro_worker_get();
+	struct coro *prev = w->prev;
+	if (prev == NULL)
+		return;
+	w->prev = NULL;
+	int state = atomic_load_explicit(&prev->state, memory_order_relaxed);
+	if (state == CORO_STATE_READY) {
+		coro_worker_push(w, prev);
+	} else if (state == CORO_STATE_FINISHED) {
+		coro_finished_push(w->rt, prev);
+	} else if (state == CORO_STATE_PARKING) {
+		atomic_store(&prev->state, CORO_STATE_SUSPENDED);
+		/*
+		 * A wakeup could come while the coroutine was
+		 * parking. It couldn't resume it then, but left the
+		 * pending flag.
+		 */
+		int expected = CORO_STATE_SUSPENDED;
+		if (atomic_exchange(&prev->is_wakeup_pending, false) &&
+		    atomic_compare_exchange_strong(&prev->state, &expected,
+						   CORO_STATE_READY))
+			coro_worker_push(w, prev);
+	} else {
+		assert(state == CORO_STATE_RUNNING);
+	}
+}
+
+/** Account the slice @a c has been running for until @a now. */
+static inline void
+coro_slice_end(struct coro_worker *w, struct coro *c, uint64_t now)
+{
+	uint64_t slice = now - c->slice_begin;
+	c->run_ticks += slice;
+	coro_hist_add(&w->slices, slice);
+	coro_hist_add(&w->overruns,
+		      slice > c->slice_ticks ? slice - c->slice_ticks : 0);
+}
+
+/**
+ * Switch from the current coroutine to @a to. The current one is
+ * handled according to its state after the switch.
+ */
 static void
 coro_yield_to(struct coro *to)
 {
-	struct coro *from = coro_this_ptr;
+	struct coro_worker *w = coro_worker_get();
+	struct coro *from = coro_this_get();
+	uint64_t now = coro_clock_ticks(&w->rt->clock);
+	if (from != &w->sched)
+		coro_slice_end(w, from, now);
+	to->slice_begin = now;
 	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	w->prev = from;
+	atomic_store_explicit(&to->state, CORO_STATE_RUNNING,
+			      memory_order_relaxed);
+	coro_this_set(to);
+	coro_ctx_switch(&from->ctx, &to->ctx);
+	coro_after_switch();
 }
 
 void
 coro_yield(void)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
+	struct coro_worker *w = coro_worker_get();
+	if (w == NULL || coro_this_get() == &w->sched)
+		return;
+	struct coro *to = coro_worker_pop(w);
+	/* Nobody else wants to run - keep working. */
 	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+		return;
+	/* Only this thread looks at it until it is queued. */
+	atomic_store_explicit(&coro_this_get()->state, CORO_STATE_READY,
+			      memory_order_relaxed);
+	coro_yield_to(to);
+}
+
+bool
+coro_yield_if_due(void)
+{
+	struct coro *c = coro_this_get();
+	if (c == NULL)
+		return false;
+	uint64_t now = coro_clock_ticks(&c->rt->clock);
+	if (now - c->slice_begin < c->slice_ticks)
+		return false;
+	struct coro_worker *w = coro_worker_get();
+	if (w == NULL || c == &w->sched)
+		return false;
+	struct coro *to = coro_worker_pop(w);
+	if (to == NULL) {
+		/*
+		 * Nobody is waiting, so the slice is over without a
+		 * switch.
+		 */
+		coro_slice_end(w, c, now);
+		c->slice_begin = now;
+		return false;
+	}
+	atomic_store_explicit(&c->state, CORO_STATE_READY,
+			      memory_order_relaxed);
+	coro_yield_to(to);
+	return true;
+}
+
+uint64_t
+coro_run_time(const struct coro *c)
+{
+	const struct coro_clock *clock = &c->rt->clock;
+	uint64_t ticks = c->run_ticks;
+	if (c == coro_this_get())
+		ticks += coro_clock_ticks(clock) - c->slice_begin;
+	return coro_clock_to_ns(clock, ticks);
+}
+
+void
+coro_sched_slice_stats(struct coro_slice_stats *stats)
+{
+	struct coro_hist *slices = calloc(2, sizeof(*slices));
+	if (slices == NULL)
+		handle_error();
+	struct coro_hist *overruns = slices + 1;
+	struct coro_rt *rt = coro_rt_get();
+	for (int i = 0; i < rt->worker_count; ++i) {
+		coro_hist_merge(slices, &rt->workers[i].slices);
+		coro_hist_merge(overruns, &rt->workers[i].overruns);
+	}
+	const struct coro_clock *clock = &rt->clock;
+	stats->count = slices->count;
+	stats->slice_p50 = coro_hist_percentile_ns(slices, 50, clock);
+	stats->slice_p99 = coro_hist_percentile_ns(slices, 99, clock);
+	stats->slice_max = coro_clock_to_ns(clock, slices->max);
+	stats->overrun_p50 = coro_hist_percentile_ns(overruns, 50, clock);
+	stats->overrun_p99 = coro_hist_percentile_ns(overruns, 99, clock);
+	stats->overrun_max = coro_clock_to_ns(clock, overruns->max);
+	free(slices);
+}
+
+void
+coro_suspend(void)
+{
+	struct coro_worker *w = coro_worker_get();
+	struct coro *from = coro_this_get();
+	assert(w != NULL && from != &w->sched);
+	if (atomic_exchange(&from->is_wakeup_pending, false))
+		return;
+	atomic_store(&from->state, CORO_STATE_PARKING);
+	struct coro *to = coro_worker_pop(w);
+	if (to == NULL)
+		to = &w->sched;
+	coro_yield_to(to);
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	atomic_store(&c->is_wakeup_pending, true);
+	int expected = CORO_STATE_SUSPENDED;
+	if (!atomic_compare_exchange_strong(&c->state, &expected,
+					    CORO_STATE_READY))
+		return;
+	atomic_store(&c->is_wakeup_pending, false);
+	struct coro_worker *w = coro_worker_get();
+	coro_worker_push(w != NULL ? w : c->worker, c);
+}
+
+static void
+coro_worker_create(struct coro_rt *rt, struct coro_worker *w)
+{
+	memset(w, 0, sizeof(*w));
+	w->rt = rt;
+	w->sched.rt = rt;
+	atomic_init(&w->sched.state, CORO_STATE_RUNNING);
+	/* The scheduler is never due to yield. */
+	w->sched.slice_ticks = UINT64_MAX;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->inbox_cond, NULL);
+}
+
+static struct coro_io *
+coro_io_new(void);
+
+static void
+coro_io_delete(struct coro_io *io);
+
+static struct coro_rt *
+coro_rt_new(int worker_count, bool is_mt)
+{
+	struct coro_rt *rt = calloc(1, sizeof(*rt));
+	if (rt == NULL)
+		handle_error();
+	coro_clock_create(&rt->clock);
+	rt->worker_count = worker_count;
+	rt->is_mt = is_mt;
+	rt->workers = calloc(worker_count, sizeof(*rt->workers));
+	if (rt->workers == NULL)
+		handle_error();
+	for (int i = 0; i < worker_count; ++i)
+		coro_worker_create(rt, &rt->workers[i]);
+	pthread_mutex_init(&rt->idle_mutex, NULL);
+	pthread_cond_init(&rt->idle_cond, NULL);
+	pthread_mutex_init(&rt->finished_mutex, NULL);
+	pthread_cond_init(&rt->finished_cond, NULL);
+	rt->main_this.rt = rt;
+	coro_stack_pool_create(&rt->stacks);
+	rt->io = coro_io_new();
+	return rt;
 }
 
 void
 coro_sched_init(void)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	struct coro_rt *rt = coro_rt_new(1, false);
+	coro_worker_ptr = &rt->workers[0];
+	coro_this_ptr = &rt->workers[0].sched;
+}
+
+/** Main loop of a worker thread. */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = arg;
+	coro_worker_ptr = w;
+	coro_this_ptr = &w->sched;
+	while (true) {
+		struct coro *c = coro_worker_next(w);
+		if (c == NULL) {
+			if (!coro_worker_sleep(w->rt))
+				break;
+			continue;
+		}
+		coro_yield_to(c);
+	}
+	return NULL;
+}
+
+void
+coro_sched_init_mt(int thread_count)
+{
+	if (thread_count < 1)
+		thread_count = 1;
+	struct coro_rt *rt = coro_rt_new(thread_count, true);
+	/* The caller is not a worker, it only waits for results. */
+	rt->main_this.slice_ticks = UINT64_MAX;
+	coro_this_ptr = &rt->main_this;
+	coro_worker_ptr = NULL;
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker *w = &rt->workers[i];
+		if (pthread_create(&w->thread, NULL, coro_worker_f, w) != 0)
+			handle_error();
+	}
+}
+
+void
+coro_sched_destroy(void)
+{
+	struct coro_rt *rt = coro_rt_get();
+	assert(rt != NULL);
+	if (rt->is_mt) {
+		pthread_mutex_lock(&rt->idle_mutex);
+		rt->is_shutdown = true;
+		pthread_cond_broadcast(&rt->idle_cond);
+		pthread_mutex_unlock(&rt->idle_mutex);
+		for (int i = 0; i < rt->worker_count; ++i)
+			pthread_join(rt->workers[i].thread, NULL);
+	}
+	coro_io_delete(rt->io);
+	for (int i = 0; i < rt->worker_count; ++i) {
+		coro_arena_destroy(&rt->workers[i].sched.arena);
+		pthread_mutex_destroy(&rt->workers[i].mutex);
+		pthread_cond_destroy(&rt->workers[i].inbox_cond);
+	}
+	free(rt->workers);
+	pthread_mutex_destroy(&rt->idle_mutex);
+	pthread_cond_destroy(&rt->idle_cond);
+	pthread_mutex_destroy(&rt->finished_mutex);
+	pthread_cond_destroy(&rt->finished_cond);
+	coro_arena_destroy(&rt->main_this.arena);
+	coro_stack_pool_destroy(&rt->stacks);
+	free(rt);
+	coro_this_ptr = NULL;
+	coro_worker_ptr = NULL;
+}
+
+static struct coro *
+coro_finished_pop(struct coro_rt *rt)
+{
+	pthread_mutex_lock(&rt->finished_mutex);
+	struct coro *c = coro_queue_pop(&rt->finished);
+	pthread_mutex_unlock(&rt->finished_mutex);
+	return c;
 }
 
 struct coro *
 coro_sched_wait(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
+	struct coro_rt *rt = coro_rt_get();
+	struct coro *c;
+	if (rt->is_mt) {
+		/*
+		 * Coroutines can be woken up from any thread, so
+		 * even if all of them are suspended now, it is not
+		 * the end.
+		 */
+		pthread_mutex_lock(&rt->finished_mutex);
+		while ((c = coro_queue_pop(&rt->finished)) == NULL &&
+		       atomic_load(&rt->coro_count) > 0) {
+			pthread_cond_wait(&rt->finished_cond,
+					  &rt->finished_mutex);
+		}
+		pthread_mutex_unlock(&rt->finished_mutex);
+	} else {
+		struct coro_worker *w = &rt->workers[0];
+		while ((c = coro_finished_pop(rt)) == NULL) {
+			struct coro *to = coro_worker_pop(w);
+			if (to != NULL) {
+				coro_yield_to(to);
+				continue;
 			}
+			/* Everything is finished or suspended. */
+			if (atomic_load(&rt->io_count) == 0)
+				return NULL;
+			/* Sleep until an I/O completion wakes someone. */
+			pthread_mutex_lock(&w->mutex);
+			while (!atomic_load(&w->has_inbox) &&
+			       atomic_load(&rt->io_count) > 0)
+				pthread_cond_wait(&w->inbox_cond, &w->mutex);
+			pthread_mutex_unlock(&w->mutex);
 		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
 	}
-	return NULL;
+	if (c != NULL)
+		atomic_fetch_sub(&rt->coro_count, 1);
+	return c;
 }
 
 struct coro *
 coro_this(void)
 {
-	return coro_this_ptr;
+	return coro_this_get();
+}
+
+/** Arena of the current coroutine, or of the thread. */
+static inline struct coro_arena *
+coro_arena_get(void)
+{
+	struct coro *c = coro_this_get();
+	return c != NULL ? &c->arena : &coro_thread_arena;
+}
+
+void *
+coro_alloc(size_t size)
+{
+	return coro_arena_alloc(coro_arena_get(), size);
+}
+
+void *
+coro_alloc_grow(void *ptr, size_t old_size, size_t new_size)
+{
+	return coro_arena_grow(coro_arena_get(), ptr, old_size, new_size);
+}
+
+void
+coro_thread_arena_destroy(void)
+{
+	coro_arena_destroy(&coro_thread_arena);
+}
+
+struct coro_alloc_mark
+coro_alloc_mark(void)
+{
+	struct coro_arena *a = coro_arena_get();
+	struct coro_alloc_mark mark = {a->top, 0};
+	if (a->top != NULL)
+		mark.used = a->top->used;
+	return mark;
+}
+
+void
+coro_alloc_rewind(struct coro_alloc_mark mark)
+{
+	coro_arena_rewind(coro_arena_get(), mark);
+}
+
+void *
+coro_alloc_rewind_keep(struct coro_alloc_mark mark, void *ptr, size_t size)
+{
+	return coro_arena_rewind_keep(coro_arena_get(), mark, ptr, size);
 }
 
 /**
- * The core part of the coroutines creation - this signal handler
- * is run on a separate stack using sigaltstack. On an invokation
- * it remembers its current context and jumps back to the
- * coroutine constructor. Later the coroutine continues from here.
+ * Leave a finished coroutine forever. The worker's scheduler
+ * reports it as finished. It is a separate function, because the
+ * coroutine could have moved to another thread.
+ */
+static __attribute__((noinline, noreturn)) void
+coro_finish(void)
+{
+	struct coro *c = coro_this_get();
+	atomic_store(&c->state, CORO_STATE_FINISHED);
+	coro_yield_to(&coro_worker_get()->sched);
+	/* Finished coroutines are never resumed. */
+	abort();
+}
+
+/**
+ * Entry point of every coroutine. It is entered on the
+ * coroutine's own stack by the first switch into it, runs the
+ * function and then leaves for the scheduler forever.
  */
 static void
-coro_body(int signum)
+coro_body(void)
 {
-	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
-	/*
-	 * On an invokation jump back to the constructor right
-	 * after remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finaly start work.
-	 */
-	coro_this_ptr = c;
+	coro_after_switch();
+	struct coro *c = coro_this_get();
 	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	/* Can not return - there is no caller on this stack. */
+	coro_finish();
 }
 
 struct coro *
 coro_new(coro_f func, void *func_arg)
 {
+	return coro_new_ex(func, func_arg, NULL);
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	size_t stack_size = CORO_STACK_SIZE_DEFAULT;
+	bool is_guarded = true;
+	uint64_t time_slice_ns = CORO_TIME_SLICE_DEFAULT_NS;
+	if (attr != NULL) {
+		if (attr->stack_size != 0)
+			stack_size = attr->stack_size;
+		is_guarded = !attr->is_guard_disabled;
+		if (attr->time_slice_ns != 0)
+			time_slice_ns = attr->time_slice_ns;
+	}
+	struct coro_rt *rt = coro_rt_get();
+	assert(rt != NULL);
 	struct coro *c = (struct coro *) malloc(sizeof(*c));
 	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
+	c->rt = rt;
+	c->stack = coro_stack_new(&rt->stacks, stack_size, is_guarded);
 	c->func = func;
 	c->func_arg = func_arg;
-	c->is_finished = false;
 	c->switch_count = 0;
+	c->slice_begin = 0;
+	c->slice_ticks = coro_clock_from_ns(&rt->clock, time_slice_ns);
+	c->run_ticks = 0;
+	memset(&c->arena, 0, sizeof(c->arena));
+	atomic_init(&c->is_wakeup_pending, false);
 	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
+	 * The stack is prepared so as the first switch to the
+	 * coroutine lands in coro_body(). No syscalls needed.
 	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-		handle_error();
+	size_t color = (atomic_fetch_add(&rt->stacks.color, 1) %
+			CORO_STACK_COLOR_COUNT) * CORO_STACK_COLOR_STEP;
+	if (color >= c->stack->size / 2)
+		color = 0;
+	coro_ctx_make(&c->ctx, coro_stack_begin(c->stack),
+		      c->stack->size - color, coro_body);
+
 	/*
-	 * New handler should jump onto a new stack and remember
-	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
+	 * Now scheduler can work with that coroutine. A worker
+	 * keeps new coroutines for itself, the others spread them
+	 * over all the workers.
 	 */
-	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
-	sigemptyset(&newsa.sa_mask);
-	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-		handle_error();
-	/* Create that new stack. */
-	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
-	newst.ss_flags = 0;
-	if (sigaltstack(&newst, &oldst) != 0)
-		handle_error();
-	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
-			sigsuspend(&suss);
+	atomic_init(&c->state, CORO_STATE_READY);
+	atomic_fetch_add(&rt->coro_count, 1);
+	struct coro_worker *w = coro_worker_get();
+	if (w == NULL) {
+		unsigned i = atomic_fetch_add(&rt->next_worker, 1);
+		w = &rt->workers[i % rt->worker_count];
+	}
+	coro_worker_push(w, c);
+	return c;
+}
+
+/*
+ * Blocking I/O is moved out of the workers. A coroutine submits a
+ * request and suspends, and the request completes in another
+ * thread which wakes the coroutine up. The kernel does the I/O
+ * asynchronously via io_uring when it is available, otherwise a
+ * few helper threads do plain read() and write().
+ */
+
+enum coro_io_op {
+	CORO_IO_READ,
+	CORO_IO_WRITE,
+	/** Stops the thread which takes it. */
+	CORO_IO_STOP,
+};
+
+struct coro_io_req {
+	enum coro_io_op op;
+	int fd;
+	void *buf;
+	size_t size;
+	/** File offset, or -1 for the current file position. */
+	off_t offset;
+	/** Result like from read() or write(). */
+	ssize_t res;
+	/** errno if res is -1. */
+	int err;
+	/** Coroutine waiting for the result. */
+	struct coro *coro;
+	/** enum coro_io_stage. */
+	atomic_int stage;
+	/** Link in the helper threads queue. */
+	struct coro_io_req *next;
+};
+
+enum coro_io_stage {
+	CORO_IO_STAGE_IN_PROGRESS,
+	/** The result is set, the coroutine is being woken up. */
+	CORO_IO_STAGE_DONE,
+	/** The I/O thread does not touch the request anymore. */
+	CORO_IO_STAGE_RELEASED,
+};
+
+enum {
+	/** Helper threads when io_uring is not available. */
+	CORO_IO_THREAD_COUNT = 4,
+	/** Submission queue size of the io_uring. */
+	CORO_IO_URING_SIZE = 256,
+	/**
+	 * Most bytes one read() or write() transfers on Linux. The
+	 * sqe length is 32 bits, so a bigger size would wrap.
+	 */
+	CORO_IO_MAX_SIZE = 0x7ffff000,
+};
+
+#if defined(__linux__) && defined(IORING_FEAT_RW_CUR_POS) && \
+    !defined(CORO_IO_NO_URING)
+#define CORO_IO_URING
+#endif
+
+#ifdef CORO_IO_URING
+
+/** io_uring rings mapped from the kernel. */
+struct coro_uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+	/** Submitted and not yet completed, up to the ring size. */
+	unsigned inflight;
+	pthread_cond_t inflight_cond;
+};
+
+#endif
+
+struct coro_io {
+	/**
+	 * Set with release once the threads are started, so a
+	 * submitter seeing it true sees the rest of the state too.
+	 */
+	atomic_bool is_created;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/** Requests for the helper threads. */
+	struct coro_io_req *head;
+	struct coro_io_req *tail;
+	/** Helper threads, or the io_uring completion thread. */
+	pthread_t threads[CORO_IO_THREAD_COUNT];
+	int thread_count;
+#ifdef CORO_IO_URING
+	bool is_uring;
+	struct coro_uring ring;
+#endif
+};
+
+/** Do the I/O right here, blocking. */
+static ssize_t
+coro_io_sync(enum coro_io_op op, int fd, void *buf, size_t size,
+	     off_t offset)
+{
+	if (op == CORO_IO_READ) {
+		if (offset < 0)
+			return read(fd, buf, size);
+		return pread(fd, buf, size, offset);
 	}
-	coro_this_ptr = old_this;
+	if (offset < 0)
+		return write(fd, buf, size);
+	return pwrite(fd, buf, size, offset);
+}
+
+/** Deliver a result and wake the coroutine up. */
+static void
+coro_io_complete(struct coro_io_req *req, ssize_t res, int err)
+{
+	struct coro_rt *rt = req->coro->rt;
+	req->res = res;
+	req->err = err;
+	atomic_store(&req->stage, CORO_IO_STAGE_DONE);
+	coro_wakeup(req->coro);
 	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
+	 * Only now, when the coroutine is surely queued, the
+	 * scheduler may stop waiting for it.
 	 */
-	if (sigaltstack(NULL, &newst) != 0)
-		handle_error();
-	newst.ss_flags = SS_DISABLE;
-	if (sigaltstack(&newst, NULL) != 0)
-		handle_error();
-	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-	    sigaltstack(&oldst, NULL) != 0)
-		handle_error();
-	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
+	atomic_fetch_sub(&rt->io_count, 1);
+	/*
+	 * After that the coroutine can leave and even be deleted,
+	 * so neither it nor the request can be touched anymore.
+	 */
+	atomic_store(&req->stage, CORO_IO_STAGE_RELEASED);
+}
+
+static void *
+coro_io_thread_f(void *arg)
+{
+	struct coro_io *io = arg;
+	while (true) {
+		pthread_mutex_lock(&io->mutex);
+		while (io->head == NULL)
+			pthread_cond_wait(&io->cond, &io->mutex);
+		struct coro_io_req *req = io->head;
+		if (req->op == CORO_IO_STOP) {
+			/* Leave it for the other threads. */
+			pthread_mutex_unlock(&io->mutex);
+			break;
+		}
+		io->head = req->next;
+		pthread_mutex_unlock(&io->mutex);
+		ssize_t res = coro_io_sync(req->op, req->fd, req->buf,
+					   req->size, req->offset);
+		coro_io_complete(req, res, res < 0 ? errno : 0);
+	}
+	return NULL;
+}
+
+#ifdef CORO_IO_URING
+
+static int
+coro_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+coro_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		 unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/** Map the rings. False if io_uring can't be used. */
+static bool
+coro_uring_create(struct coro_uring *r)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = coro_uring_setup(CORO_IO_URING_SIZE, &p);
+	if (r->fd < 0)
+		return false;
+	/* Reads and writes at the current file position. */
+	if ((p.features & IORING_FEAT_RW_CUR_POS) == 0)
+		goto error_close;
+	r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_size = p.cq_off.cqes +
+			 p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0 &&
+	    r->cq_map_size > r->sq_map_size)
+		r->sq_map_size = r->cq_map_size;
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto error_close;
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED)
+			goto error_unmap_sq;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto error_unmap_cq;
+	char *sq = r->sq_map, *cq = r->cq_map;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->inflight = 0;
+	pthread_cond_init(&r->inflight_cond, NULL);
+	return true;
+
+error_unmap_cq:
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_size);
+error_unmap_sq:
+	munmap(r->sq_map, r->sq_map_size);
+error_close:
+	close(r->fd);
+	return false;
+}
+
+static void
+coro_uring_destroy(struct coro_uring *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_size);
+	munmap(r->sq_map, r->sq_map_size);
+	close(r->fd);
+	pthread_cond_destroy(&r->inflight_cond);
+}
+
+/** Put a request into the ring and let the kernel start it. */
+static void
+coro_uring_submit(struct coro_io *io, struct coro_io_req *req)
+{
+	struct coro_uring *r = &io->ring;
+	pthread_mutex_lock(&io->mutex);
+	/*
+	 * Completions can't overflow when there are no more
+	 * requests in flight than the ring size.
+	 */
+	while (r->inflight == CORO_IO_URING_SIZE)
+		pthread_cond_wait(&r->inflight_cond, &io->mutex);
+	++r->inflight;
+	unsigned tail = *r->sq_tail;
+	unsigned index = tail & r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	if (req->op == CORO_IO_READ) {
+		sqe->opcode = IORING_OP_READ;
+	} else if (req->op == CORO_IO_WRITE) {
+		sqe->opcode = IORING_OP_WRITE;
+	} else {
+		sqe->opcode = IORING_OP_NOP;
+	}
+	sqe->fd = req->fd;
+	sqe->addr = (uintptr_t)req->buf;
+	/* A short count, like read() and write() give for these sizes. */
+	sqe->len = req->size < CORO_IO_MAX_SIZE ?
+		   req->size : CORO_IO_MAX_SIZE;
+	/* -1 means the current file position. */
+	sqe->off = req->offset < 0 ? (uint64_t)-1 : (uint64_t)req->offset;
+	sqe->user_data = (uintptr_t)req;
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	int rc;
+	while ((rc = coro_uring_enter(r->fd, 1, 0, 0)) < 0 &&
+	       (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+		;
+	if (rc < 0)
 		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+	pthread_mutex_unlock(&io->mutex);
+}
+
+/** Wait for completions and hand them out to the coroutines. */
+static void *
+coro_uring_thread_f(void *arg)
+{
+	struct coro_io *io = arg;
+	struct coro_uring *r = &io->ring;
+	bool is_stopped = false;
+	while (!is_stopped) {
+		if (coro_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			handle_error();
+		unsigned head = *r->cq_head;
+		unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		unsigned count = tail - head;
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+			struct coro_io_req *req =
+				(struct coro_io_req *)(uintptr_t)cqe->user_data;
+			if (req->op == CORO_IO_STOP) {
+				is_stopped = true;
+				continue;
+			}
+			if (cqe->res < 0)
+				coro_io_complete(req, -1, -cqe->res);
+			else
+				coro_io_complete(req, cqe->res, 0);
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		if (count == 0)
+			continue;
+		pthread_mutex_lock(&io->mutex);
+		r->inflight -= count;
+		pthread_cond_broadcast(&r->inflight_cond);
+		pthread_mutex_unlock(&io->mutex);
+	}
+	return NULL;
+}
+
+#endif
+
+/** Start io_uring or the helper threads on the first request. */
+static void
+coro_io_create(struct coro_io *io)
+{
+	pthread_mutex_lock(&io->mutex);
+	if (atomic_load_explicit(&io->is_created, memory_order_relaxed)) {
+		pthread_mutex_unlock(&io->mutex);
+		return;
+	}
+#ifdef CORO_IO_URING
+	io->is_uring = coro_uring_create(&io->ring);
+	if (io->is_uring) {
+		if (pthread_create(&io->threads[0], NULL,
+				   coro_uring_thread_f, io) != 0)
+			handle_error();
+		io->thread_count = 1;
+	}
+#endif
+	if (io->thread_count == 0) {
+		for (int i = 0; i < CORO_IO_THREAD_COUNT; ++i) {
+			if (pthread_create(&io->threads[i], NULL,
+					   coro_io_thread_f, io) != 0)
+				handle_error();
+		}
+		io->thread_count = CORO_IO_THREAD_COUNT;
+	}
+	atomic_store_explicit(&io->is_created, true, memory_order_release);
+	pthread_mutex_unlock(&io->mutex);
+}
+
+static void
+coro_io_submit(struct coro_io *io, struct coro_io_req *req)
+{
+	if (!atomic_load_explicit(&io->is_created, memory_order_acquire))
+		coro_io_create(io);
+#ifdef CORO_IO_URING
+	if (io->is_uring) {
+		coro_uring_submit(io, req);
+		return;
+	}
+#endif
+	pthread_mutex_lock(&io->mutex);
+	req->next = NULL;
+	if (io->head == NULL)
+		io->head = req;
+	else
+		io->tail->next = req;
+	io->tail = req;
+	pthread_cond_signal(&io->cond);
+	pthread_mutex_unlock(&io->mutex);
+}
+
+static struct coro_io *
+coro_io_new(void)
+{
+	struct coro_io *io = calloc(1, sizeof(*io));
+	if (io == NULL)
 		handle_error();
+	atomic_init(&io->is_created, false);
+	pthread_mutex_init(&io->mutex, NULL);
+	pthread_cond_init(&io->cond, NULL);
+	return io;
+}
 
-	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
-	return c;
+static void
+coro_io_delete(struct coro_io *io)
+{
+	if (atomic_load(&io->is_created)) {
+		struct coro_io_req stop;
+		memset(&stop, 0, sizeof(stop));
+		stop.op = CORO_IO_STOP;
+		coro_io_submit(io, &stop);
+		pthread_mutex_lock(&io->mutex);
+		pthread_cond_broadcast(&io->cond);
+		pthread_mutex_unlock(&io->mutex);
+		for (int i = 0; i < io->thread_count; ++i)
+			pthread_join(io->threads[i], NULL);
+#ifdef CORO_IO_URING
+		if (io->is_uring)
+			coro_uring_destroy(&io->ring);
+#endif
+	}
+	pthread_mutex_destroy(&io->mutex);
+	pthread_cond_destroy(&io->cond);
+	free(io);
+}
+
+/**
+ * Do the I/O in another thread while the current coroutine is
+ * suspended. Outside of coroutines it is just a blocking call.
+ */
+static ssize_t
+coro_io_do(enum coro_io_op op, int fd, void *buf, size_t size,
+	   off_t offset)
+{
+	struct coro_worker *w = coro_worker_get();
+	if (w == NULL || coro_this_get() == &w->sched)
+		return coro_io_sync(op, fd, buf, size, offset);
+	struct coro_io_req req;
+	req.op = op;
+	req.fd = fd;
+	req.buf = buf;
+	req.size = size;
+	req.offset = offset;
+	req.coro = coro_this_get();
+	atomic_init(&req.stage, CORO_IO_STAGE_IN_PROGRESS);
+	atomic_fetch_add(&req.coro->rt->io_count, 1);
+	coro_io_submit(req.coro->rt->io, &req);
+	while (atomic_load(&req.stage) == CORO_IO_STAGE_IN_PROGRESS)
+		coro_suspend();
+	/* The I/O thread is finishing coro_wakeup(), a short wait. */
+	while (atomic_load(&req.stage) != CORO_IO_STAGE_RELEASED)
+		coro_yield();
+	if (req.res < 0)
+		errno = req.err;
+	return req.res;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	return coro_io_do(CORO_IO_READ, fd, buf, size, -1);
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	return coro_io_do(CORO_IO_WRITE, fd, (void *)buf, size, -1);
+}
+
+ssize_t
+coro_pread(int fd, void *buf, size_t size, off_t offset)
+{
+	return coro_io_do(CORO_IO_READ, fd, buf, size, offset);
+}
+
+ssize_t
+coro_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+	return coro_io_do(CORO_IO_WRITE, fd, (void *)buf, size, offset);
 }
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
@@ -10,8 +13,27 @@ void
 coro_sched_init(void);
 
 /**
- * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * Run coroutines on @a thread_count worker threads instead of
+ * the current one. Each worker has its own queue of ready
+ * coroutines and steals from the others when the own queue is
+ * empty. A coroutine can continue in another thread after any
+ * switch. The current thread only waits in coro_sched_wait().
+ * Use instead of coro_sched_init().
+ */
+void
+coro_sched_init_mt(int thread_count);
+
+/**
+ * Stop the worker threads, if any, and free the scheduler
+ * resources. All the coroutines must be deleted by that moment.
+ */
+void
+coro_sched_destroy(void);
+
+/**
+ * Block until any coroutine has finished. It is returned. NULL,
+ * if no coroutines. In the single-threaded mode also NULL, if
+ * all the remaining ones are suspended.
  */
 struct coro *
 coro_sched_wait(void);
@@ -27,6 +49,34 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/** Optional coroutine settings. Zero fields mean defaults. */
+struct coro_attr {
+	/**
+	 * Usable stack size in bytes, 1MB by default. It is
+	 * rounded up to the page size.
+	 */
+	size_t stack_size;
+	/**
+	 * Don't place a PROT_NONE page below the stack. Saves a
+	 * kernel memory area per coroutine, but an overflow is not
+	 * caught.
+	 */
+	bool is_guard_disabled;
+	/**
+	 * How long the coroutine may run before
+	 * coro_yield_if_due() gives the control away. 1ms by
+	 * default.
+	 */
+	uint64_t time_slice_ns;
+};
+
+/**
+ * Same as coro_new(), but with settings. @a attr can be NULL.
+ * Stacks are cached and reused after coro_delete().
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -42,6 +92,142 @@ coro_is_finished(const struct coro *c);
 void
 coro_delete(struct coro *c);
 
-/** Switch to another not finished coroutine. */
+/**
+ * Switch to the next ready coroutine. The current one goes to
+ * the end of the ready queue. Does nothing if no other coroutine
+ * is ready.
+ */
 void
 coro_yield(void);
+
+/**
+ * Yield if the current coroutine has been running for its time
+ * slice or longer. Costs a read of the CPU timestamp counter when
+ * not due, so can be called often. Returns true if yielded.
+ */
+bool
+coro_yield_if_due(void);
+
+/** Time the coroutine has been running, in nanoseconds. */
+uint64_t
+coro_run_time(const struct coro *c);
+
+/**
+ * Statistics of all the slices run by the coroutines so far. A
+ * slice lasts from a switch into a coroutine until it switches
+ * out or is found due by coro_yield_if_due(). An overrun is how
+ * much longer than its time slice a coroutine was running. The
+ * times are in nanoseconds.
+ */
+struct coro_slice_stats {
+	uint64_t count;
+	uint64_t slice_p50;
+	uint64_t slice_p99;
+	uint64_t slice_max;
+	uint64_t overrun_p50;
+	uint64_t overrun_p99;
+	uint64_t overrun_max;
+};
+
+/**
+ * Collect the slice statistics. Call it when the coroutines are
+ * not running, for example after coro_sched_wait() returned all.
+ */
+void
+coro_sched_slice_stats(struct coro_slice_stats *stats);
+
+/**
+ * Allocate @a size bytes aligned by 16 from the arena of the
+ * current coroutine. Costs a pointer bump. There is no free - all
+ * the memory is released in one go by coro_delete(), or by
+ * coro_alloc_rewind(). Outside of coroutines the arena of the
+ * scheduler thread is used, released by coro_sched_destroy(), and
+ * a per-thread one when there is no scheduler, released by
+ * coro_thread_arena_destroy(). Returns NULL when out of memory.
+ */
+void *
+coro_alloc(size_t size);
+
+/**
+ * Release the arena coro_alloc() uses in the current thread when
+ * it has no scheduler. The thread can allocate again after that.
+ */
+void
+coro_thread_arena_destroy(void);
+
+/**
+ * Resize @a ptr, allocated by coro_alloc() with @a old_size. If it
+ * is the last allocation and there is room, it is resized in
+ * place. Otherwise a new block is allocated and the data is
+ * copied, and the old one stays until the arena is released.
+ * There must be no marks taken after @a ptr was allocated.
+ */
+void *
+coro_alloc_grow(void *ptr, size_t old_size, size_t new_size);
+
+/** Position in the arena of the current coroutine. */
+struct coro_alloc_mark {
+	void *chunk;
+	size_t used;
+};
+
+/** Remember the current position in the arena. */
+struct coro_alloc_mark
+coro_alloc_mark(void);
+
+/**
+ * Release everything allocated after the @a mark was taken. The
+ * marks must be rewound in the reverse order.
+ */
+void
+coro_alloc_rewind(struct coro_alloc_mark mark);
+
+/**
+ * Same as coro_alloc_rewind(), but the last allocation @a ptr of
+ * @a size bytes survives and is moved to the @a mark. Useful when
+ * a result is built next to temporary buffers. Returns the new
+ * address of the data.
+ */
+void *
+coro_alloc_rewind_keep(struct coro_alloc_mark mark, void *ptr, size_t size);
+
+/**
+ * Block the current coroutine until someone calls coro_wakeup()
+ * on it. It is not scheduled until then. Can return spuriously,
+ * so the awaited condition should be checked in a loop.
+ */
+void
+coro_suspend(void);
+
+/**
+ * Make a suspended coroutine ready to run. Can be called from
+ * any thread. If the coroutine is not suspended yet, its next
+ * coro_suspend() returns immediately.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/** Name of the context switch backend chosen at build time. */
+const char *
+coro_backend_name(void);
+
+/**
+ * Like read(), but only the current coroutine waits for the
+ * disk. The others keep working. Done via io_uring, or by helper
+ * threads where it is not available. Outside of coroutines it is
+ * a plain read().
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/** Like write(), see coro_read(). */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/** Like pread(), see coro_read(). */
+ssize_t
+coro_pread(int fd, void *buf, size_t size, off_t offset);
+
+/** Like pwrite(), see coro_read(). */
+ssize_t
+coro_pwrite(int fd, const void *buf, size_t size, off_t offset);
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libcoro.h"
+
+/**
+ * Microbenchmark of the libcoro primitives. Build it with each
+ * context switch backend and compare:
+ *
+ * $> make bench_coro
+ */
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+yield_loop(void *arg)
+{
+	long count = *(long *)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+static int
+empty_func(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static void
+wait_all(void)
+{
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+}
+
+/** Two coroutines ping-pong via coro_yield(). */
+static void
+bench_yield(long count)
+{
+	coro_new(yield_loop, &count);
+	coro_new(yield_loop, &count);
+	double start = now_ns();
+	wait_all();
+	double total = now_ns() - start;
+	printf("%-12s coro_yield: %8.1f ns\n", coro_backend_name(),
+	       total / (2 * count));
+}
+
+/**
+ * Switch cost depending on how many coroutines there are. It
+ * should not grow with the count. Stacks are small and without
+ * guard pages, so 100k of them fit into the kernel limits.
+ */
+static void
+bench_yield_scale(long total_switches)
+{
+	struct coro_attr attr = {
+		.stack_size = 16 * 1024,
+		.is_guard_disabled = true,
+	};
+	for (int count = 10; count <= 100000; count *= 10) {
+		long rounds = total_switches / count;
+		/* Amortize the first touch of each stack. */
+		if (rounds < 100)
+			rounds = 100;
+		for (int i = 0; i < count; ++i)
+			coro_new_ex(yield_loop, &rounds, &attr);
+		double start = now_ns();
+		wait_all();
+		double total = now_ns() - start;
+		printf("%-12s coro_yield with %6d coros: %8.1f ns\n",
+		       coro_backend_name(), count, total / (rounds * count));
+	}
+}
+
+/** Creation cost, including the first switch into a coroutine. */
+static void
+bench_new(int count)
+{
+	double start = now_ns();
+	for (int i = 0; i < count; ++i) {
+		coro_new(empty_func, NULL);
+		wait_all();
+	}
+	double total = now_ns() - start;
+	printf("%-12s coro_new:   %8.3f us\n", coro_backend_name(),
+	       total / count / 1000);
+}
+
+int
+main(int argc, char **argv)
+{
+	long yield_count = argc > 1 ? atol(argv[1]) : 1000000;
+	int new_count = argc > 2 ? atoi(argv[2]) : 10000;
+	coro_sched_init();
+	bench_yield(yield_count);
+	bench_yield_scale(yield_count);
+	bench_new(new_count);
+	return 0;
+}
@@ -1,101 +1,196 @@
 #include <stdio.h>
+#include <stdbool.h>
 #include "mergesort.h"
 #include "util.h"
 #include "libcoro.h"
-
+#include "simd_sort.h"
+
+enum {
+	/** Runs of this size or less are sorted by insertions. */
+	INSERTION_SORT_CUTOFF = 16,
+};
+
+/**
+ * Everything a sort needs at each recursion level, so as not to
+ * pass it all through the arguments.
+ */
+struct sort_context {
+	size_t element_size;
+	int (*comparator)(const void *, const void *);
+	/** One element, for the insertion sort. */
+	void* tmp;
+};
 
 int merge(
-	void* array, size_t m,
-	size_t r, size_t element_size, 
+	const void* src, size_t m,
+	size_t r, void* dst, size_t element_size,
 	int (*comparator)(const void *, const void *)){
-		void* left_array = malloc(m * element_size);
-		void* right_array = malloc((r - m) * element_size);
-
-		if (left_array == NULL || right_array == NULL) {
-			return -1;
+		const char* left = src;
+		const char* left_end = left + m * element_size;
+		const char* right = left_end;
+		const char* right_end = left + r * element_size;
+		char* out = dst;
+
+		while (left < left_end && right < right_end){
+			/* Equal elements are taken from the left, the sort is stable. */
+			if (comparator(left, right) > 0){
+				memcpy(out, right, element_size);
+				right += element_size;
+			}
+			else {
+				memcpy(out, left, element_size);
+				left += element_size;
+			}
+			out += element_size;
 		}
 
-		for (size_t i = 0; i < m; i++){
-			memcpy((left_array + i * element_size), (array + i * element_size), element_size);
-		}
+		memcpy(out, left, left_end - left);
+		out += left_end - left;
+		memcpy(out, right, right_end - right);
 
-		for (size_t i = 0; i < r - m; i++){
-			memcpy((right_array + i * element_size), (array + (i + m) * element_size), element_size);
-		}
+		return 0;
+	}
 
-		size_t left_index = 0;
-		size_t right_index = 0;
-		size_t merged_index = 0;
+void merge_int_runs(const int* a, size_t na, const int* b, size_t nb, int* dst){
+	size_t left = 0;
+	size_t right = 0;
+	size_t out = 0;
+
+	while (left < na && right < nb){
+		int x = a[left];
+		int y = b[right];
+		bool is_right = y < x;
+		dst[out++] = is_right ? y : x;
+		left += !is_right;
+		right += is_right;
+	}
 
-		while (left_index < m && right_index < r - m){
-			void* array_element = array + merged_index * element_size;
-			void* left_element = left_array + left_index * element_size;
-			void* right_element = right_array + right_index * element_size;
+	memcpy(dst + out, a + left, (na - left) * sizeof(int));
+	out += na - left;
+	memcpy(dst + out, b + right, (nb - right) * sizeof(int));
+}
 
-			int cmp = comparator(left_element, right_element);
+void merge_int(const int* src, size_t m, size_t r, int* dst){
+	merge_int_runs(src, m, src + m, r - m, dst);
+}
 
-			if (cmp > 0){
-				memcpy(array_element, right_element, element_size);
-				right_index++;
-			}
-			else {
-				memcpy(array_element, left_element, element_size);
-				left_index++;
-			}
+static void insertion_sort(char* array, size_t elements, struct sort_context* ctx){
+	size_t size = ctx->element_size;
+	for (size_t i = 1; i < elements; i++){
+		char* pos = array + i * size;
+		if (ctx->comparator(pos - size, pos) <= 0)
+			continue;
+		memcpy(ctx->tmp, pos, size);
+		do {
+			memcpy(pos, pos - size, size);
+			pos -= size;
+		} while (pos > array && ctx->comparator(pos - size, ctx->tmp) > 0);
+		memcpy(pos, ctx->tmp, size);
+	}
+}
 
-			merged_index++;
+void insertion_sort_int(int* array, size_t elements){
+	for (size_t i = 1; i < elements; i++){
+		int value = array[i];
+		size_t j = i;
+		while (j > 0 && array[j - 1] > value){
+			array[j] = array[j - 1];
+			j--;
 		}
+		array[j] = value;
+	}
+}
 
-		while (left_index < m) {
-			memcpy((array + merged_index * element_size), (left_array + left_index * element_size), element_size); 
-			left_index++; 
-			merged_index++;
-		}
+/**
+ * Sort @a elements from @a src into @a dst. Both buffers hold the
+ * same data on input. The halves are sorted from @a dst into
+ * @a src, and then merged back, so the buffers swap their roles
+ * on each level and no copying is needed.
+ */
+static void sort_level(char* src, char* dst, size_t elements, struct sort_context* ctx){
+	if (elements <= INSERTION_SORT_CUTOFF){
+		insertion_sort(dst, elements, ctx);
+		return;
+	}
+	size_t m = elements / 2;
+	size_t offset = m * ctx->element_size;
+	sort_level(dst, src, m, ctx);
+	sort_level(dst + offset, src + offset, elements - m, ctx);
+	merge(src, m, elements, dst, ctx->element_size, ctx->comparator);
 
-		while (right_index < r - m) {
-			memcpy((array + merged_index * element_size), (right_array + right_index * element_size), element_size);
-			right_index++; 
-			merged_index++;
-		}
+	coro_yield_if_due();
+}
 
-		free(left_array);
-		free(right_array);
+static void sort_level_int(int* src, int* dst, size_t elements, struct sort_context* ctx){
+	if (elements <= INSERTION_SORT_CUTOFF){
+		insertion_sort_int(dst, elements);
+		return;
+	}
+	size_t m = elements / 2;
+	sort_level_int(dst, src, m, ctx);
+	sort_level_int(dst + m, src + m, elements - m, ctx);
+	merge_int(src, m, elements, dst);
 
-		return 0;
+	coro_yield_if_due();
+}
+
+/**
+ * Same as sort_level_int(), but the leaves are whole blocks for the
+ * vector kernel, and the halves are split at block boundaries.
+ */
+static void sort_level_simd(int* src, int* dst, size_t elements, struct sort_context* ctx){
+	if (elements <= SIMD_SORT_BLOCK){
+		if (elements == SIMD_SORT_BLOCK)
+			simd_sort_block(dst);
+		else
+			insertion_sort_int(dst, elements);
+		return;
 	}
+	size_t blocks = (elements + SIMD_SORT_BLOCK - 1) / SIMD_SORT_BLOCK;
+	size_t m = blocks / 2 * SIMD_SORT_BLOCK;
+	sort_level_simd(dst, src, m, ctx);
+	sort_level_simd(dst + m, src + m, elements - m, ctx);
+	simd_merge_int(src, m, elements, dst);
 
+	coro_yield_if_due();
+}
 
 int custom_mergesort(
 	void *array,
 	size_t elements, size_t element_size,
-	int (*comparator)(const void *, const void *),
-	struct timespec* start_time,
-	float latency,
-	double* yield_delay_time
+	int (*comparator)(const void *, const void *)
 ){  
-	int status = 0;
-
-	if (elements > 1){
-		size_t m = elements / 2;
-		size_t r = elements;
-
-		void* left_array = array;
-		size_t left_array_size = m;
-
-		void* right_array = array + m * element_size;
-		size_t right_array_size = r - m; 
-
-		custom_mergesort(left_array, left_array_size, element_size, comparator, start_time, latency, yield_delay_time);
-		custom_mergesort(right_array, right_array_size, element_size, comparator, start_time, latency, yield_delay_time);
- 
-		status = merge(array, m, r, element_size, comparator);
+	if (elements < 2)
+		return 0;
 
-		yield_on_time(start_time, latency, yield_delay_time);
+	/* The only allocation for the whole sort, from the arena. */
+	struct coro_alloc_mark mark = coro_alloc_mark();
+	void* scratch = coro_alloc(elements * element_size + element_size);
+	if (scratch == NULL)
+		return -1;
+	memcpy(scratch, array, elements * element_size);
+
+	struct sort_context ctx = {
+		element_size, comparator,
+		(char*)scratch + elements * element_size,
+	};
+
+	if (comparator == int_lt_cmp && element_size == sizeof(int)){
+		if (simd_sort_is_vector())
+			sort_level_simd(scratch, array, elements, &ctx);
+		else
+			sort_level_int(scratch, array, elements, &ctx);
 	}
+	else
+		sort_level(scratch, array, elements, &ctx);
 
-	return status;
+	coro_alloc_rewind(mark);
+	return 0;
 }
 
 int int_lt_cmp(const void* p1, const void* p2){
-	return (*(int*)p1 - *(int*)p2);
-}
\ No newline at end of file
+	int a = *(const int*)p1;
+	int b = *(const int*)p2;
+	/* Subtraction could overflow. */
+	return (a > b) - (a < b);
+}
@@ -4,17 +4,38 @@
 #include <string.h>
 #include <time.h>
 
+/**
+ * Merge sorted runs src[0, m) and src[m, r) into dst. Elements
+ * are @a element_size bytes each.
+ */
 int merge(
-	void* array, size_t m,
-	size_t r, size_t element_size, 
+	const void* src, size_t m,
+	size_t r, void* dst, size_t element_size,
 	int (*comparator)(const void *, const void *));
 
+/**
+ * Merge of int runs a[0, na) and b[0, nb) into dst, without
+ * comparator calls and without branches. Equal ints are taken
+ * from @a a first.
+ */
+void merge_int_runs(const int* a, size_t na, const int* b, size_t nb, int* dst);
+
+/** Same as merge() for ints in ascending order. */
+void merge_int(const int* src, size_t m, size_t r, int* dst);
+
+/** Insertion sort of ints, for short runs. */
+void insertion_sort_int(int* array, size_t elements);
+
+/**
+ * Stable merge sort. Allocates one scratch buffer for the whole
+ * sort. Ints compared by int_lt_cmp go through a specialized path
+ * without comparator calls, vectorized when the CPU allows it.
+ * Calls coro_yield_if_due() after each merge. Returns -1 if out
+ * of memory.
+ */
 int custom_mergesort(
 	void *array,
 	size_t elements, size_t element_size,
-	int (*comparator)(const void *, const void *),
-	struct timespec* start_time,
-	float latency,
-	double* yield_delay_time);
+	int (*comparator)(const void *, const void *));
 
 int int_lt_cmp(const void* p1, const void* p2);
\ No newline at end of file
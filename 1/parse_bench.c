@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "int_file.h"
+#include "libcoro.h"
+
+/**
+ * Compare the block parser with the old two-pass fscanf() way on
+ * the given files, for example made by generator.py. Binary int
+ * files are only mapped and checksummed:
+ *
+ * $> make bench_parse
+ */
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/** The old way: count the numbers, rewind, and scan again. */
+static int
+fscanf_parse(const char *filename, int **array)
+{
+	FILE *file = fopen(filename, "r");
+	if (file == NULL)
+		return -1;
+	int count = 0, tmp;
+	while (fscanf(file, "%d", &tmp) == 1)
+		++count;
+	fseek(file, 0, SEEK_SET);
+	*array = malloc(count * sizeof(int));
+	for (int i = 0; i < count; ++i) {
+		if (fscanf(file, "%d", &(*array)[i]) != 1)
+			break;
+	}
+	fclose(file);
+	return count;
+}
+
+static int
+block_parse(const char *filename, int **array)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	int count;
+	if (read_numbers(fd, array, &count) != 0)
+		count = -1;
+	close(fd);
+	return count;
+}
+
+/** Load time of a binary int file, or -1 if it is not one. */
+static int
+bench_int_file(const char *filename, int rounds, double mb)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct int_file file;
+	double map_us = 0;
+	size_t count = 0;
+	for (int i = 0; i < rounds; ++i) {
+		double start = now_us();
+		if (int_file_map(fd, &file) != 0) {
+			close(fd);
+			return -1;
+		}
+		map_us += now_us() - start;
+		count = file.count;
+		int_file_unmap(&file);
+	}
+	close(fd);
+	printf("%s (%zu numbers): map %.1f MB/s, %.1f M numbers/s\n",
+	       filename, count, mb * 1e6 / map_us,
+	       (double)count * rounds / map_us);
+	return 0;
+}
+
+static void
+bench_file(const char *filename, int rounds)
+{
+	struct stat st;
+	if (stat(filename, &st) != 0) {
+		printf("%s: no such file\n", filename);
+		return;
+	}
+	double mb = (double)st.st_size * rounds / (1024 * 1024);
+	if (bench_int_file(filename, rounds, mb) == 0)
+		return;
+	double fscanf_us = 0, block_us = 0;
+	int fscanf_count = 0, block_count = 0;
+	for (int i = 0; i < rounds; ++i) {
+		int *array;
+		double start = now_us();
+		fscanf_count = fscanf_parse(filename, &array);
+		fscanf_us += now_us() - start;
+		free(array);
+
+		struct coro_alloc_mark mark = coro_alloc_mark();
+		start = now_us();
+		block_count = block_parse(filename, &array);
+		block_us += now_us() - start;
+		coro_alloc_rewind(mark);
+	}
+	if (fscanf_count != block_count) {
+		printf("%s: count mismatch %d != %d\n", filename,
+		       fscanf_count, block_count);
+		return;
+	}
+	printf("%s (%d numbers): fscanf %.1f MB/s, block %.1f MB/s, "
+	       "%.1f M numbers/s\n", filename, block_count, mb * 1e6 / fscanf_us,
+	       mb * 1e6 / block_us, (double)block_count * rounds / block_us);
+}
+
+int
+main(int argc, char **argv)
+{
+	for (int i = 1; i < argc; ++i)
+		bench_file(argv[i], 5);
+	coro_thread_arena_destroy();
+	return 0;
+}
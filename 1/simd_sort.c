@@ -0,0 +1,214 @@
+#include "simd_sort.h"
+#include "mergesort.h"
+
+#include <stdbool.h>
+
+#if defined(__x86_64__) && !defined(SIMD_SORT_NO_VECTOR)
+#define SIMD_SORT_AVX2
+#include <immintrin.h>
+#endif
+
+static void
+sort_block_scalar(int *array)
+{
+	insertion_sort_int(array, SIMD_SORT_BLOCK);
+}
+
+#ifdef SIMD_SORT_AVX2
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 void
+minmax(__m256i *a, __m256i *b)
+{
+	__m256i t = *a;
+	*a = _mm256_min_epi32(t, *b);
+	*b = _mm256_max_epi32(t, *b);
+}
+
+/** Sort a bitonic sequence of 8 ints. */
+static inline AVX2 __m256i
+bitonic_clean(__m256i v)
+{
+	/* Distance 4: swap the 128-bit halves. */
+	__m256i t = _mm256_permute2x128_si256(v, v, 1);
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, t),
+			       _mm256_max_epi32(v, t), 0xF0);
+	/* Distance 2. */
+	t = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, t),
+			       _mm256_max_epi32(v, t), 0xCC);
+	/* Distance 1. */
+	t = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, t),
+			       _mm256_max_epi32(v, t), 0xAA);
+	return v;
+}
+
+/**
+ * Merge two sorted vectors. The lower 8 ints end up in @a a, the
+ * upper ones in @a b, both sorted.
+ */
+static inline AVX2 void
+bitonic_merge(__m256i *a, __m256i *b)
+{
+	const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i r = _mm256_permutevar8x32_epi32(*b, reverse);
+	__m256i lo = _mm256_min_epi32(*a, r);
+	__m256i hi = _mm256_max_epi32(*a, r);
+	*a = bitonic_clean(lo);
+	*b = bitonic_clean(hi);
+}
+
+static AVX2 void
+merge_int_avx2(const int *src, size_t m, size_t r, int *dst)
+{
+	const int *a = src, *a_end = src + m;
+	const int *b = src + m, *b_end = src + r;
+	if (m < 8 || r - m < 8) {
+		merge_int_runs(a, m, b, r - m, dst);
+		return;
+	}
+	__m256i lo = _mm256_loadu_si256((const __m256i *)a);
+	__m256i hi = _mm256_loadu_si256((const __m256i *)b);
+	a += 8;
+	b += 8;
+	bitonic_merge(&lo, &hi);
+	_mm256_storeu_si256((__m256i *)dst, lo);
+	dst += 8;
+	/*
+	 * @a hi keeps the 8 biggest ints seen so far. The next 8 are
+	 * taken from the run with the smaller head, then the lower
+	 * half of the merge can't be beaten by anything left.
+	 */
+	while (a + 8 <= a_end && b + 8 <= b_end) {
+		if (*a < *b) {
+			lo = _mm256_loadu_si256((const __m256i *)a);
+			a += 8;
+		} else {
+			lo = _mm256_loadu_si256((const __m256i *)b);
+			b += 8;
+		}
+		bitonic_merge(&lo, &hi);
+		_mm256_storeu_si256((__m256i *)dst, lo);
+		dst += 8;
+	}
+	/*
+	 * One of the runs has less than 8 ints left. Merge them with
+	 * the register, and then the result with the other run.
+	 */
+	int tail[8], head[16];
+	_mm256_storeu_si256((__m256i *)tail, hi);
+	const int *rest = a, *rest_end = a_end;
+	const int *other = b, *other_end = b_end;
+	if (a_end - a >= 8) {
+		rest = b;
+		rest_end = b_end;
+		other = a;
+		other_end = a_end;
+	}
+	size_t head_size = 8 + (rest_end - rest);
+	merge_int_runs(tail, 8, rest, rest_end - rest, head);
+	merge_int_runs(head, head_size, other, other_end - other, dst);
+}
+
+static AVX2 void
+sort_block_avx2(int *array)
+{
+	__m256i r[8];
+	for (int i = 0; i < 8; i++)
+		r[i] = _mm256_loadu_si256((const __m256i *)(array + i * 8));
+	/* Optimal 19-comparator network for 8 inputs, on columns. */
+	minmax(&r[0], &r[2]); minmax(&r[1], &r[3]);
+	minmax(&r[4], &r[6]); minmax(&r[5], &r[7]);
+	minmax(&r[0], &r[4]); minmax(&r[1], &r[5]);
+	minmax(&r[2], &r[6]); minmax(&r[3], &r[7]);
+	minmax(&r[0], &r[1]); minmax(&r[2], &r[3]);
+	minmax(&r[4], &r[5]); minmax(&r[6], &r[7]);
+	minmax(&r[2], &r[4]); minmax(&r[3], &r[5]);
+	minmax(&r[1], &r[4]); minmax(&r[3], &r[6]);
+	minmax(&r[1], &r[2]); minmax(&r[3], &r[4]); minmax(&r[5], &r[6]);
+	/* Transpose, so that each row becomes a sorted column. */
+	__m256i t[8], u[8];
+	for (int i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (int i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; i++) {
+		r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+	/* Runs of 16 in registers, then 32 and 64 through memory. */
+	for (int i = 0; i < 8; i += 2) {
+		bitonic_merge(&r[i], &r[i + 1]);
+		_mm256_storeu_si256((__m256i *)(array + i * 8), r[i]);
+		_mm256_storeu_si256((__m256i *)(array + i * 8 + 8), r[i + 1]);
+	}
+	int tmp[SIMD_SORT_BLOCK];
+	merge_int_avx2(array, 16, 32, tmp);
+	merge_int_avx2(array + 32, 16, 32, tmp + 32);
+	merge_int_avx2(tmp, 32, 64, array);
+}
+
+#endif /* SIMD_SORT_AVX2 */
+
+/** One implementation of the kernels. */
+struct simd_sort_backend {
+	const char *name;
+	void (*sort_block)(int *array);
+	void (*merge_int)(const int *src, size_t m, size_t r, int *dst);
+};
+
+static const struct simd_sort_backend simd_sort_scalar = {
+	"scalar", sort_block_scalar, merge_int,
+};
+
+#ifdef SIMD_SORT_AVX2
+static const struct simd_sort_backend simd_sort_avx2 = {
+	"avx2", sort_block_avx2, merge_int_avx2,
+};
+#endif
+
+/**
+ * The features are detected by the compiler runtime once at
+ * startup, so this is only a load and a test.
+ */
+static const struct simd_sort_backend *
+simd_sort_backend(void)
+{
+#ifdef SIMD_SORT_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return &simd_sort_avx2;
+#endif
+	return &simd_sort_scalar;
+}
+
+bool
+simd_sort_is_vector(void)
+{
+	return simd_sort_backend() != &simd_sort_scalar;
+}
+
+const char *
+simd_sort_backend_name(void)
+{
+	return simd_sort_backend()->name;
+}
+
+void
+simd_sort_block(int *array)
+{
+	simd_sort_backend()->sort_block(array);
+}
+
+void
+simd_merge_int(const int *src, size_t m, size_t r, int *dst)
+{
+	simd_sort_backend()->merge_int(src, m, r, dst);
+}
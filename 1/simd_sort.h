@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Vectorized kernels for sorting ints: a sorting network for
+ * fixed-size blocks and a bitonic merge of sorted runs. The
+ * implementation is picked on each call by the CPU features.
+ * Build with -DSIMD_SORT_NO_VECTOR to always use the scalar one.
+ */
+
+enum {
+	/** Number of ints sorted by simd_sort_block(). */
+	SIMD_SORT_BLOCK = 64,
+};
+
+/** True if a vector implementation is used on this CPU. */
+bool
+simd_sort_is_vector(void);
+
+/** Name of the used implementation: "avx2" or "scalar". */
+const char *
+simd_sort_backend_name(void);
+
+/** Sort exactly SIMD_SORT_BLOCK ints in place. */
+void
+simd_sort_block(int *array);
+
+/** Merge sorted runs src[0, m) and src[m, r) into dst. */
+void
+simd_merge_int(const int *src, size_t m, size_t r, int *dst);
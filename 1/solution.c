@@ -1,44 +1,57 @@
 #include <stdio.h>
 #include <time.h>
+#include <stdbool.h>
 #include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "mergesort.h"
 #include "containers.h"
 #include "util.h"
 #include "libcoro.h"
+#include "kway_merge.h"
+#include "external_sort.h"
 
 /**
  * You can compile and run this code using the commands:
  *
  * $> gcc solution.c libcoro.c
- * $> ./a.out
+ * $> ./a.out [-j threads] [-m megabytes] [-w] coroutine_count latency file...
+ *
+ * With -j the coroutines run on that many threads, and the final
+ * merge is split between them. With -m the files don't have to
+ * fit into memory: they are sorted by parts spilled to temporary
+ * files, using about that much memory. With -w all the numbers in
+ * out.txt have the same width, padded with spaces.
  */
 
 struct my_context {
 	int i;
 	double coroutine_latency;
-	char* name;
-	int* total_numbers_count;
+	char name[16];
+	atomic_int* total_numbers_count;
 	struct filename_container* filename_container;
 	struct array_container** array_containers;
+	/** Set in the external sort mode. */
+	struct external_sort* external_sort;
 };
 
 static struct my_context *
-my_context_new(int i, double coroutine_latency, char* name, int* total_numbers_count, struct filename_container* filename_container, struct array_container** array_containers)
+my_context_new(int i, double coroutine_latency, char* name, atomic_int* total_numbers_count, struct filename_container* filename_container, struct array_container** array_containers, struct external_sort* external_sort)
 {
 	struct my_context *ctx = malloc(sizeof(*ctx));
 	ctx->i = i;
 	ctx->coroutine_latency = coroutine_latency;
-	ctx->name = strdup(name);
+	snprintf(ctx->name, sizeof(ctx->name), "%s", name);
 	ctx->filename_container = filename_container;
 	ctx->total_numbers_count = total_numbers_count;
 	ctx->array_containers = array_containers;
+	ctx->external_sort = external_sort;
 	return ctx;
 }
 
 static void
 my_context_delete(struct my_context *ctx)
 {
-	free(ctx->name);
 	free(ctx);
 }
 
@@ -49,50 +62,76 @@ my_context_delete(struct my_context *ctx)
 static int
 coroutine_mergesort_single_file(void *context)
 {	
-	double yield_delay_time = 0;
-	struct timespec coroutine_start_time, coroutine_end_time;
-	clock_gettime(CLOCK_MONOTONIC, &coroutine_start_time);
-
 	struct coro *this = coro_this();
 	struct my_context *ctx = context;
 	
 	printf("Started coroutine %s\n", ctx->name);
 
-	while (ctx->filename_container->current_file_index < ctx->filename_container->count) {
-		int file_index = ctx->filename_container->current_file_index;
+	int file_index;
+	while ((file_index = atomic_fetch_add(&ctx->filename_container->current_file_index, 1)) < ctx->filename_container->count) {
 		char* filename = ctx->filename_container->filenames[file_index];
 
 		printf("Coroutine %s sorting file %s...\n", ctx->name, filename);
 
-		FILE* file = fopen(filename, "r");
-		if (!file) {
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0) {
 			my_context_delete(ctx);
 			return 0;
 		}
 
-		ctx->filename_container->current_file_index += 1;
-
-		int numbers_count = count_numbers_in_file(file);
-		*ctx->total_numbers_count += numbers_count;
+		if (ctx->external_sort != NULL) {
+			ssize_t count = external_sort_spill(ctx->external_sort, fd);
+			close(fd);
+			if (count < 0) {
+				fprintf(stderr, "Failed to sort %s\n", filename);
+				my_context_delete(ctx);
+				return 0;
+			}
+			atomic_fetch_add(ctx->total_numbers_count, count);
+			continue;
+		}
 
-		ctx->array_containers[file_index] = malloc(sizeof(struct array_container));
-		ctx->array_containers[file_index]->array = malloc(numbers_count * sizeof(int));
-		ctx->array_containers[file_index]->size = numbers_count;
-		initialize_array(file, ctx->array_containers[file_index]->array);
-		fclose(file);
+		/*
+		 * The container and the array live in the arena of the
+		 * coroutine, which is deleted after the final merge.
+		 */
+		struct array_container* container = coro_alloc(sizeof(struct array_container));
+		if (container == NULL) {
+			close(fd);
+			my_context_delete(ctx);
+			return 0;
+		}
+		memset(container, 0, sizeof(*container));
+		/* Binary int files are sorted right in their private mapping. */
+		int rc = int_file_map(fd, &container->file);
+		if (rc == 0 && container->file.count > INT_MAX) {
+			int_file_unmap(&container->file);
+			rc = -1;
+		}
+		if (rc == 0) {
+			container->array = container->file.array;
+			container->size = container->file.count;
+		}
+		if (rc < 0 || (rc > 0 && read_numbers(fd, &container->array, &container->size) != 0)) {
+			fprintf(stderr, "Failed to read %s\n", filename);
+			close(fd);
+			my_context_delete(ctx);
+			return 0;
+		}
+		close(fd);
 
-		struct timespec start_time;
-		clock_gettime(CLOCK_MONOTONIC, &start_time);
+		int numbers_count = container->size;
+		atomic_fetch_add(ctx->total_numbers_count, numbers_count);
+		ctx->array_containers[file_index] = container;
 
-		custom_mergesort(ctx->array_containers[file_index]->array, numbers_count, sizeof(int), int_lt_cmp, &start_time, ctx->coroutine_latency, &yield_delay_time);
+		/* Yields once the time slice of the coroutine is over. */
+		custom_mergesort(ctx->array_containers[file_index]->array, numbers_count, sizeof(int), int_lt_cmp);
 	}
 
 	printf("%s: switch count after other function %lld\n", ctx->name,
 			coro_switch_count(this));
 
-	clock_gettime(CLOCK_MONOTONIC, &coroutine_end_time);
-
-	printf("%s: execution time = %f s\n", ctx->name, (get_time_difference(coroutine_start_time, coroutine_end_time) - yield_delay_time) / 1000000);
+	printf("%s: execution time = %f s\n", ctx->name, coro_run_time(this) / 1e9);
 	
 	my_context_delete(ctx);
 	/* This will be returned from coro_status(). */
@@ -108,17 +147,43 @@ main(int argc, char **argv)
 	clock_gettime(CLOCK_MONOTONIC, &monotime_start);
 
 	/* Startup arguments initialization */
+	int thread_count = 0;
+	size_t memory_budget = 0;
+	bool is_fixed_width = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:m:w")) != -1) {
+		if (opt == 'j') {
+			thread_count = atoi(optarg);
+		} else if (opt == 'm') {
+			memory_budget = (size_t)atol(optarg) * 1024 * 1024;
+		} else if (opt == 'w') {
+			is_fixed_width = true;
+		} else {
+			fprintf(stderr, "Usage: %s [-j threads] [-m megabytes] [-w] coroutine_count latency file...\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	int file_count = argc - 3;
 	int corountine_count = atoi(argv[1]);
 	double target_latency = atof(argv[2]);
 	double coroutine_latency = (target_latency / corountine_count); // microseconds
 
-	int total_numbers_count = 0;
-	struct array_container** array_containers = malloc(file_count * sizeof(struct array_container*));
+	atomic_int total_numbers_count = 0;
+	struct array_container** array_containers = calloc(file_count, sizeof(struct array_container*));
 	struct filename_container filename_container = {file_count, 0, &argv[3]};
 
+	struct external_sort external_sort;
+	if (memory_budget > 0 && external_sort_create(&external_sort, memory_budget, corountine_count) != 0)
+		exit(EXIT_FAILURE);
+
 	/* Initialize our coroutine global cooperative scheduler. */
-	coro_sched_init();
+	if (thread_count > 1)
+		coro_sched_init_mt(thread_count);
+	else
+		coro_sched_init();
 	
 	/* Start several coroutines. */
 
@@ -131,64 +196,89 @@ main(int argc, char **argv)
 		char name[16];
 		sprintf(name, "coro_%d", i + 1);
 
-		coro_new(
+		struct coro_attr attr = {0};
+		attr.time_slice_ns = coroutine_latency * 1000;
+		coro_new_ex(
 			coroutine_mergesort_single_file, 
-			my_context_new(i, coroutine_latency, name, &total_numbers_count, &filename_container, array_containers));
+			my_context_new(i, coroutine_latency, name, &total_numbers_count, &filename_container, array_containers,
+				       memory_budget > 0 ? &external_sort : NULL),
+			&attr);
 	}
 
-	/* Wait for all the coroutines to end. */
+	/*
+	 * Wait for all the coroutines to end. They keep the sorted
+	 * arrays in their arenas, so are deleted after the merge.
+	 */
+	struct coro** finished = calloc(corountine_count, sizeof(struct coro*));
+	int finished_count = 0;
 	struct coro* c;
 	while ((c = coro_sched_wait()) != NULL) {
-		if (c != NULL){
-			printf("Finished with status %d\n", coro_status(c));
-			coro_delete(c);
-		}
+		printf("Finished with status %d\n", coro_status(c));
+		finished[finished_count++] = c;
 	}
 	/* All coroutines have finished. */
 
-	/* IMPLEMENT MERGING OF THE SORTED ARRAYS HERE. */
+	/* Merge the sorted arrays. */
 
-	FILE *output_file = fopen("out.txt", "w");
-	if (output_file == NULL) {
+	int output_fd = open("out.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (output_fd < 0) {
 		exit(EXIT_FAILURE);
 	}
 
-	int *pos = (int *)calloc(file_count, sizeof(int));
-
-	int min = INT_MAX;
-	int array_index_with_min = 0;
-	int count_index = 0; 
-
-	while (1){
-		min = INT_MAX;
-
-		for (int i = 0; i < file_count; ++i) {
-			if (pos[i] < array_containers[i]->size){
-				int current_element = array_containers[i]->array[pos[i]];
-				if (current_element < min){
-					min = current_element;
-					array_index_with_min = i;
-				}
-			}
-		}
-		fprintf(output_file, "%d ", min);
-
-		pos[array_index_with_min] += 1;
+	struct merge_source *sources = calloc(file_count, sizeof(struct merge_source));
+	int source_count = 0;
+	for (int i = 0; i < file_count; ++i) {
+		/* Files which failed to be read have no container. */
+		if (array_containers[i] == NULL)
+			continue;
+		sources[source_count].pos = array_containers[i]->array;
+		sources[source_count].end = array_containers[i]->array + array_containers[i]->size;
+		source_count++;
+	}
 
-		count_index++;
-		if (count_index == total_numbers_count){
-			break;
-		}
+	struct number_writer writer;
+	if (number_writer_create(&writer, output_fd, false) != 0) {
+		exit(EXIT_FAILURE);
 	}
+	writer.is_fixed_width = is_fixed_width;
+	int rc;
+	if (memory_budget > 0) {
+		/* The runs are merged by coroutines too. */
+		rc = external_sort_merge(&external_sort, &writer);
+		external_sort_destroy(&external_sort);
+	} else if (thread_count > 1) {
+		/* Each worker thread merges its own range of the output. */
+		rc = kway_merge_parallel(sources, source_count, thread_count, output_fd, is_fixed_width);
+	} else {
+		rc = kway_merge(sources, source_count, &writer);
+	}
+	if (number_writer_destroy(&writer) != 0 || rc != 0) {
+		fprintf(stderr, "Failed to write out.txt\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Check that the coroutines kept within the target latency. */
+	struct coro_slice_stats stats;
+	coro_sched_slice_stats(&stats);
+	printf("Time slices: %llu, target %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+	       (unsigned long long)stats.count, coroutine_latency, stats.slice_p50 / 1e3,
+	       stats.slice_p99 / 1e3, stats.slice_max / 1e3);
+	printf("Slice overrun: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+	       stats.overrun_p50 / 1e3, stats.overrun_p99 / 1e3, stats.overrun_max / 1e3);
 
 	for (int i = 0; i < file_count; ++i){
-		free(array_containers[i]->array);
-		free(array_containers[i]);
+		if (array_containers[i] != NULL && array_containers[i]->file.map != NULL)
+			int_file_unmap(&array_containers[i]->file);
 	}
+	/* Releases the arrays and the containers at once. */
+	for (int i = 0; i < finished_count; ++i)
+		coro_delete(finished[i]);
+	coro_sched_destroy();
 
-	free(pos);
+	free(finished);
+	free(sources);
 	free(array_containers);
-	fclose(output_file);
+	close(output_fd);
 
 
 	/* Setting up end time */
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libcoro.h"
+#include "mergesort.h"
+#include "simd_sort.h"
+
+/**
+ * Sorting speed of custom_mergesort() on ints with the picked
+ * kernel. The Makefile builds it with and without the vector one:
+ *
+ * $> make bench_simd
+ */
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+bench_sort(size_t count, int rounds)
+{
+	int *origin = malloc(count * sizeof(int));
+	int *array = malloc(count * sizeof(int));
+	srand(count);
+	for (size_t i = 0; i < count; ++i)
+		origin[i] = rand() - RAND_MAX / 2;
+	double best = 0;
+	for (int i = 0; i < rounds; ++i) {
+		memcpy(array, origin, count * sizeof(int));
+		double t = now_us();
+		custom_mergesort(array, count, sizeof(int), int_lt_cmp);
+		t = now_us() - t;
+		if (i == 0 || t < best)
+			best = t;
+	}
+	for (size_t i = 1; i < count; ++i) {
+		if (array[i - 1] > array[i]) {
+			printf("not sorted at %zu\n", i);
+			exit(1);
+		}
+	}
+	printf("%-8s %9zu ints: %8.1f ms, %6.1f M ints/s\n",
+	       simd_sort_backend_name(), count, best / 1e3, count / best);
+	free(origin);
+	free(array);
+}
+
+int
+main(void)
+{
+	bench_sort(1000, 1000);
+	bench_sort(100000, 20);
+	bench_sort(1000000, 5);
+	bench_sort(10000000, 2);
+	/* custom_mergesort() took its scratch from the thread's arena. */
+	coro_thread_arena_destroy();
+	return 0;
+}
@@ -1,45 +1,232 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <stdbool.h>
 #include "util.h"
 #include "libcoro.h"
 
-int count_numbers_in_file(FILE* file){
-	int numbers_count = 0;
+enum {
+	/** How much of the file is read at once. */
+	PARSE_BLOCK_SIZE = 64 * 1024,
+	/**
+	 * Spaces after the data in the buffer, so 8 bytes can be
+	 * loaded at any position inside the data.
+	 */
+	PARSE_PADDING = 16,
+	/**
+	 * Longest token which can be carried over to the next
+	 * block. Longer ones are not numbers anyway.
+	 */
+	PARSE_MAX_TOKEN = 64,
+};
 
-	int tmp;
-	while (!feof(file)) {
-		fscanf(file, "%d", &tmp);
-		++numbers_count;
-	}
+#define REPEAT_BYTE(b) (0x0101010101010101ULL * (b))
+
+/**
+ * Count leading decimal digits in 8 bytes loaded from memory
+ * (little-endian, the first char in the lowest byte). No
+ * branches: a byte gets its high bit set if it is not a digit.
+ */
+static inline int
+count_digits8(uint64_t chunk)
+{
+	uint64_t is_above_9 = chunk + REPEAT_BYTE(0x80 - '9' - 1);
+	uint64_t is_at_least_0 = chunk + REPEAT_BYTE(0x80 - '0');
+	/* Non-ASCII bytes could carry into the next byte. */
+	uint64_t non_digit = (is_above_9 | ~is_at_least_0 | chunk) &
+			     REPEAT_BYTE(0x80);
+	if (non_digit == 0)
+		return 8;
+	return __builtin_ctzll(non_digit) / 8;
+}
 
-	fseek(file, 0, SEEK_SET);
-	return numbers_count;
+/** Convert the first @a len digits (1..8) of @a chunk to a number. */
+static inline uint32_t
+parse_digits8(uint64_t chunk, int len)
+{
+	/* Leading zero bytes work as leading '0' digits. */
+	uint64_t val = (chunk - REPEAT_BYTE('0')) << (64 - 8 * len);
+	val = (val * 10) + (val >> 8);
+	val = (((val & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+	       (((val >> 16) & 0x000000FF000000FFULL) *
+		(1 + (10000ULL << 32)))) >> 32;
+	return (uint32_t)val;
 }
 
-void initialize_array(FILE* file, int* array){
-	int i = 0;
-	while (!feof(file)) {
-		fscanf(file, "%d", &array[i]);
-		++i;
+/**
+ * Parse all complete numbers in [pos, end). Stores them into the
+ * array, growing it when needed if @a can_grow is set. Otherwise
+ * stops when the array is full. Returns where parsing stopped: at
+ * the last incomplete token, at the first number that did not
+ * fit, or @a end. The buffer must be padded with PARSE_PADDING
+ * spaces. At the end of the file @a is_eof says that the last
+ * token is complete.
+ */
+static const char*
+parse_numbers(const char* pos, const char* end, bool is_eof, bool can_grow, int** array, size_t* size, size_t* capacity){
+	while (true) {
+		/* Separators are anything but digits and '-'. */
+		while (pos < end && (unsigned char)(*pos - '0') > 9 && *pos != '-')
+			++pos;
+		if (pos >= end)
+			return end;
+
+		const char* token = pos;
+		bool is_negative = *pos == '-';
+		pos += is_negative;
+
+		uint64_t chunk;
+		memcpy(&chunk, pos, sizeof(chunk));
+		int len = count_digits8(chunk);
+		uint64_t value = len > 0 ? parse_digits8(chunk, len) : 0;
+		pos += len;
+		if (len == 8) {
+			unsigned digit;
+			while ((digit = (unsigned char)(*pos - '0')) <= 9) {
+				value = value * 10 + digit;
+				++pos;
+			}
+		}
+		/* Ran into the padding - the rest is in the next block. */
+		if (pos >= end && !is_eof)
+			return token;
+		/* A lone '-'. */
+		if (pos == token + is_negative)
+			continue;
+
+		if (*size == *capacity) {
+			if (!can_grow)
+				return token;
+			int* new_array = coro_alloc_grow(*array, *capacity * sizeof(int), *capacity * 2 * sizeof(int));
+			if (new_array == NULL)
+				return NULL;
+			*array = new_array;
+			*capacity *= 2;
+		}
+		(*array)[(*size)++] = (int)(is_negative ? -value : value);
 	}
+}
 
-	fseek(file, 0, SEEK_SET);
+int read_numbers(int fd, int** result, int* result_size){
+	/* The block buffer is dropped at the end, the array is kept. */
+	struct coro_alloc_mark mark = coro_alloc_mark();
+	char* buffer = coro_alloc(PARSE_BLOCK_SIZE + PARSE_PADDING);
+	size_t capacity = 1024;
+	size_t size = 0;
+	int* array = coro_alloc(capacity * sizeof(int));
+	if (buffer == NULL || array == NULL)
+		goto error;
+
+	size_t carry = 0;
+	bool is_eof = false;
+	while (!is_eof) {
+		ssize_t rc = coro_read(fd, buffer + carry, PARSE_BLOCK_SIZE - carry);
+		if (rc < 0)
+			goto error;
+		size_t used = carry + rc;
+		is_eof = rc == 0;
+		memset(buffer + used, ' ', PARSE_PADDING);
+
+		const char* end = buffer + used;
+		const char* rest = parse_numbers(buffer, end, is_eof, true, &array, &size, &capacity);
+		if (rest == NULL)
+			goto error;
+		/* The count is returned as int. */
+		if (size > INT_MAX)
+			goto error;
+		carry = end - rest;
+		if (carry > PARSE_MAX_TOKEN)
+			goto error;
+		memmove(buffer, rest, carry);
+		/* Reads of cached data often complete without a switch. */
+		coro_yield_if_due();
+	}
+
+	*result = coro_alloc_rewind_keep(mark, array, size * sizeof(int));
+	*result_size = size;
+	return 0;
+
+error:
+	coro_alloc_rewind(mark);
+	return -1;
 }
 
-double get_time_difference(struct timespec monotime_start, struct timespec monotime_end){
-	long long elapsed_ns = (monotime_end.tv_sec - monotime_start.tv_sec) * 1000000000 + (monotime_end.tv_nsec - monotime_start.tv_nsec);
-	return (double) elapsed_ns / 1000;
+int number_reader_create(struct number_reader* reader, int fd){
+	reader->fd = fd;
+	reader->begin = 0;
+	reader->end = 0;
+	reader->is_eof = false;
+	reader->buffer = coro_alloc(PARSE_BLOCK_SIZE + PARSE_PADDING);
+	if (reader->buffer == NULL)
+		return -1;
+	memset(reader->buffer, ' ', PARSE_PADDING);
+	return 0;
 }
 
-void yield_on_time(struct timespec* start_time, double coroutine_latency, double* yield_delay_time){
-	struct timespec current_time, yield_start_time, yield_end_time;
-	clock_gettime(CLOCK_MONOTONIC, &current_time);
+int number_reader_read(struct number_reader* reader, int* array, int capacity){
+	size_t size = 0;
+	size_t array_capacity = capacity;
+	while (true) {
+		char* buffer = reader->buffer;
+		const char* end = buffer + reader->end;
+		const char* rest = parse_numbers(buffer + reader->begin, end, reader->is_eof, false, &array, &size, &array_capacity);
+		reader->begin = rest - buffer;
+		if (size == array_capacity || reader->is_eof)
+			return size;
+
+		/* Only an incomplete token is left, read the next block. */
+		size_t carry = end - rest;
+		if (carry > PARSE_MAX_TOKEN)
+			return -1;
+		memmove(buffer, rest, carry);
+		ssize_t rc = coro_read(reader->fd, buffer + carry, PARSE_BLOCK_SIZE - carry);
+		if (rc < 0)
+			return -1;
+		reader->begin = 0;
+		reader->end = carry + rc;
+		reader->is_eof = rc == 0;
+		memset(buffer + reader->end, ' ', PARSE_PADDING);
+		coro_yield_if_due();
+	}
+}
 
-	double time_difference = get_time_difference(*start_time, current_time);
+/** Decimal text of all numbers 0..99, two chars each. */
+static const char digit_pairs[201] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
 
-	if (time_difference >= coroutine_latency){
-		clock_gettime(CLOCK_MONOTONIC, &yield_start_time);
-		coro_yield();
-		clock_gettime(CLOCK_MONOTONIC, &yield_end_time);
-		*start_time = yield_end_time;
-		*yield_delay_time += get_time_difference(yield_start_time, yield_end_time);
+size_t format_int(int value, char* out){
+	char* pos = out;
+	unsigned int u = value;
+	if (value < 0){
+		*pos++ = '-';
+		u = 0u - u;
+	}
+	/* Two digits per division, from the end. */
+	char tmp[10];
+	char* t = tmp + sizeof(tmp);
+	while (u >= 100){
+		unsigned int q = u / 100;
+		t -= 2;
+		memcpy(t, digit_pairs + (u - q * 100) * 2, 2);
+		u = q;
 	}
+	if (u >= 10){
+		t -= 2;
+		memcpy(t, digit_pairs + u * 2, 2);
+	}
+	else
+		*--t = '0' + u;
+	size_t len = tmp + sizeof(tmp) - t;
+	memcpy(pos, t, len);
+	return pos - out + len;
+}
+
+double get_time_difference(struct timespec monotime_start, struct timespec monotime_end){
+	long long elapsed_ns = (monotime_end.tv_sec - monotime_start.tv_sec) * 1000000000 + (monotime_end.tv_nsec - monotime_start.tv_nsec);
+	return (double) elapsed_ns / 1000;
 }
\ No newline at end of file
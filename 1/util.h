@@ -2,8 +2,51 @@
 
 #include <time.h>
 #include <stdio.h>
+#include <stdbool.h>
 
-int count_numbers_in_file(FILE* file);
-void initialize_array(FILE* file, int* array);
-double get_time_difference(struct timespec monotime_start, struct timespec monotime_end);
-void yield_on_time(struct timespec* monotime_start, double latency, double* yield_delay_time);
\ No newline at end of file
+/**
+ * Read all whitespace-separated integers from the file in one
+ * pass. The file is read by blocks via coro_read(), so other
+ * coroutines work while this one waits for the disk. The result
+ * array is allocated by coro_alloc() and grows geometrically.
+ * Returns 0 on success, -1 on error or if there are more than
+ * INT_MAX numbers.
+ */
+int read_numbers(int fd, int** array, int* size);
+
+/**
+ * Reads whitespace-separated integers from a file by portions of
+ * limited size, with the same parser as read_numbers().
+ */
+struct number_reader {
+	int fd;
+	char* buffer;
+	/** Not parsed yet data in the buffer. */
+	size_t begin;
+	size_t end;
+	bool is_eof;
+};
+
+/**
+ * The buffer is allocated by coro_alloc() and is released with
+ * the rest of the arena. Returns 0 on success, -1 on error.
+ */
+int number_reader_create(struct number_reader* reader, int fd);
+
+/**
+ * Read up to @a capacity next numbers into @a array. Returns
+ * their count, 0 at the end of the file, -1 on error.
+ */
+int number_reader_read(struct number_reader* reader, int* array, int capacity);
+
+enum {
+	/** Enough space for format_int() of any int. */
+	FORMAT_INT_MAX = 11,
+};
+
+/**
+ * Write decimal text of @a value to @a out, without terminating
+ * zero. Returns the text length, at most FORMAT_INT_MAX.
+ */
+size_t format_int(int value, char* out);
+double get_time_difference(struct timespec monotime_start, struct timespec monotime_end);
\ No newline at end of file
@@ -4,12 +4,9 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
-
-struct parser {
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
-};
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 enum token_type {
 	TOKEN_TYPE_NONE,
@@ -23,82 +20,198 @@ enum token_type {
 	TOKEN_TYPE_BACKGROUND,
 };
 
+/**
+ * Tokens are not copied while parsing. A string token is a slice
+ * of the parser buffer as long as it is contiguous there. Only
+ * when a quote or an escape is dropped from its middle, the text
+ * moves to the parser scratch. The offsets are not pointers, so as
+ * they survive the buffer reallocation when more data is fed in
+ * the middle of a line.
+ */
 struct token {
 	enum token_type type;
-	char *data;
+	/** The text is in the scratch, not in the buffer. */
+	bool is_scratch;
+	/** Offset in the scratch, or in the buffer from the line begin. */
+	uint32_t offset;
+	uint32_t size;
+};
+
+struct expr_draft;
+
+/** Which tokens the line expects next. */
+enum parser_state {
+	/** Commands and the operators between them. */
+	PARSER_STATE_COMMANDS,
+	/** The file name after '>' or '>>'. */
+	PARSER_STATE_OUT_FILE,
+	/** After the redirect or '&', only '&' or the line end. */
+	PARSER_STATE_LINE_END,
+	/** The line has an error, its rest is skipped. */
+	PARSER_STATE_SKIP,
+};
+
+/**
+ * The parser keeps the state of the line it parses between the
+ * feeds: the words, exprs and the token cut by the end of the data.
+ * Each call goes on from where the previous one stopped, so a long
+ * line fed by small parts is still read once, not from its begin
+ * after each part.
+ */
+struct parser {
+	char *buffer;
+	/** Data before it is parsed and consumed already. */
+	uint32_t begin;
 	uint32_t size;
 	uint32_t capacity;
+	/** Where the lexer stopped, from the line begin. */
+	uint32_t pos;
+	/** The token being read, it can be not finished yet. */
+	struct token token;
+	/** The token has started, leading whitespace is skipped. */
+	bool is_in_token;
+	bool is_in_comment;
+	/** The open quote of the token, or 0. */
+	char quote;
+	enum parser_state state;
+	/** The error of the skipped line. */
+	enum parser_error error;
+	enum output_type out_type;
+	struct token out_file;
+	bool is_background;
+	/**
+	 * Text of the tokens which are not contiguous in the buffer,
+	 * because quotes or escapes were removed from them.
+	 */
+	char *scratch;
+	uint32_t scratch_size;
+	uint32_t scratch_capacity;
+	/** Words of the line being parsed. */
+	struct token *words;
+	uint32_t word_count;
+	uint32_t word_capacity;
+	/** Expressions of the line being parsed. */
+	struct expr_draft *exprs;
+	uint32_t expr_count;
+	uint32_t expr_capacity;
+};
+
+/** An expression of the line, before the line is built. */
+struct expr_draft {
+	enum expr_type type;
+	/** Words of a command, the first one is exe. */
+	uint32_t first_word;
+	uint32_t word_count;
 };
 
-static char *
-token_strdup(const struct token *t)
+/**
+ * Chars which can end or change a word: all the whitespace and
+ * control chars, quotes, escapes, operators and comments. Ordinary
+ * chars between them are taken by whole runs.
+ */
+static const bool parser_is_special[256] = {
+	[0 ... ' '] = true,
+	['"'] = true, ['#'] = true, ['&'] = true, ['\''] = true,
+	['>'] = true, ['\\'] = true, ['|'] = true,
+};
+
+/** Find the first special char in [pos, end), or end. */
+static inline const char *
+parser_find_special(const char *pos, const char *end)
 {
-	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
-	res[t->size] = 0;
-	return res;
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i quote = _mm_set1_epi8('#');
+	const __m128i squote = _mm_set1_epi8('\'');
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i greater = _mm_set1_epi8('>');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i bar = _mm_set1_epi8('|');
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		/* Unsigned v <= ' '. */
+		__m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, space), v);
+		/* '"' and '#', '&' and '\'' differ only in the low bit. */
+		__m128i v1 = _mm_or_si128(v, one);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v1, quote));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v1, squote));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, greater));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, backslash));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bar));
+		int mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+	while (pos < end && !parser_is_special[(unsigned char)*pos])
+		++pos;
+	return pos;
 }
 
 static void
-token_append(struct token *t, char c)
+parser_scratch_append(struct parser *p, const char *src, uint32_t len)
 {
-	if (t->size == t->capacity) {
-		t->capacity = (t->capacity + 1) * 2;
-		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
-	} else {
-		assert(t->size < t->capacity);
+	if (p->scratch_capacity - p->scratch_size < len) {
+		uint32_t new_capacity = (p->scratch_capacity + 1) * 2;
+		if (new_capacity - p->scratch_size < len)
+			new_capacity = p->scratch_size + len;
+		p->scratch = realloc(p->scratch, new_capacity);
+		p->scratch_capacity = new_capacity;
 	}
-	t->data[t->size++] = c;
+	memcpy(p->scratch + p->scratch_size, src, len);
+	p->scratch_size += len;
 }
 
-static void
-token_reset(struct token *t)
+/** Start of the current line in the buffer. */
+static inline const char *
+parser_line(const struct parser *p)
 {
-	t->size = 0;
-	t->type = TOKEN_TYPE_NONE;
+	return p->buffer + p->begin;
 }
 
+/** Append @a len chars of the parser buffer at @a src to the token. */
 static void
-command_append_arg(struct command *cmd, char *arg)
+token_append(struct parser *p, struct token *t, const char *src, uint32_t len)
 {
-	if (cmd->arg_count == cmd->arg_capacity) {
-		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
-	} else {
-		assert(cmd->arg_count < cmd->arg_capacity);
+	uint32_t offset = src - parser_line(p);
+	if (!t->is_scratch) {
+		if (t->size == 0)
+			t->offset = offset;
+		if (t->offset + t->size == offset) {
+			t->size += len;
+			return;
+		}
+		/* Something was skipped, the text is not a slice anymore. */
+		const char *text = parser_line(p) + t->offset;
+		t->offset = p->scratch_size;
+		parser_scratch_append(p, text, t->size);
+		t->is_scratch = true;
 	}
-	cmd->args[cmd->arg_count++] = arg;
+	parser_scratch_append(p, src, len);
+	t->size += len;
 }
 
-void
-command_line_delete(struct command_line *line)
+static inline const char *
+token_text(const struct parser *p, const struct token *t)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
-	}
-	free(line->out_file);
-	free(line);
+	return t->is_scratch ? p->scratch + t->offset : parser_line(p) + t->offset;
 }
 
 static void
-command_line_append(struct command_line *line, struct expr *e)
+token_reset(struct token *t, uint32_t offset)
 {
-	if (line->head == NULL)
-		line->head = e;
-	else
-		line->tail->next = e;
-	line->tail = e;
+	t->type = TOKEN_TYPE_NONE;
+	t->is_scratch = false;
+	t->offset = offset;
+	t->size = 0;
+}
+
+void
+command_line_delete(struct command_line *line)
+{
+	/* The exprs and all the strings are in the same block. */
+	free(line);
 }
 
 struct parser *
@@ -110,6 +223,15 @@ parser_new(void)
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
+	/* The buffer can be NULL yet, even memcpy() of 0 bytes is UB. */
+	if (len == 0)
+		return;
+	if (p->capacity - p->size < len && p->begin > 0) {
+		/* Drop the consumed data instead of growing. */
+		memmove(p->buffer, p->buffer + p->begin, p->size - p->begin);
+		p->size -= p->begin;
+		p->begin = 0;
+	}
 	uint32_t cap = p->capacity - p->size;
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
@@ -123,56 +245,100 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 	assert(p->size <= p->capacity);
 }
 
+/** Drop the parsed line and start the next one. */
 static void
-parser_consume(struct parser *p, uint32_t size)
+parser_next_line(struct parser *p)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	assert(!p->is_in_token);
+	assert(p->size - p->begin >= p->pos);
+	p->begin += p->pos;
+	if (p->begin == p->size) {
+		p->begin = 0;
 		p->size = 0;
-		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
+	p->pos = 0;
+	p->state = PARSER_STATE_COMMANDS;
+	p->error = PARSER_ERR_NONE;
+	p->out_type = OUTPUT_TYPE_STDOUT;
+	p->is_background = false;
+	p->scratch_size = 0;
+	p->word_count = 0;
+	p->expr_count = 0;
 }
 
-static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+/** Finish the token and continue the line after @a pos. */
+static inline bool
+parse_token_end(struct parser *p, enum token_type type, const char *pos)
 {
-	token_reset(out);
-	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
+	p->token.type = type;
+	p->pos = pos - parser_line(p);
+	p->is_in_token = false;
+	p->quote = 0;
+	return true;
+}
+
+/**
+ * Read the next token into p->token. Returns false if the data ends
+ * before the token does. Then the token and the lexer state stay in
+ * the parser, and the next call goes on from the same place when
+ * more data is fed. Only a trailing backslash or operator char is
+ * looked at again, because it depends on the char after it.
+ */
+static bool
+parse_token(struct parser *p)
+{
+	const char *pos = parser_line(p) + p->pos;
+	const char *end = p->buffer + p->size;
+	struct token *out = &p->token;
+	if (!p->is_in_token) {
+		while (pos < end) {
+			if (!isspace(*pos))
+				break;
+			if (*pos == '\n')
+				return parse_token_end(p, TOKEN_TYPE_NEW_LINE, pos + 1);
+			++pos;
 		}
-		++pos;
+		if (pos == end)
+			goto need_more;
+		token_reset(out, pos - parser_line(p));
+		p->is_in_token = true;
+	}
+	if (p->is_in_comment) {
+		const char *nl = memchr(pos, '\n', end - pos);
+		if (nl == NULL) {
+			pos = end;
+			goto need_more;
+		}
+		p->is_in_comment = false;
+		return parse_token_end(p, TOKEN_TYPE_NEW_LINE, nl + 1);
 	}
-	char quote = 0;
 	while (pos < end) {
+		const char *stop = parser_find_special(pos, end);
+		if (stop != pos) {
+			token_append(p, out, pos, stop - pos);
+			pos = stop;
+			if (pos == end)
+				break;
+		}
 		char c = *pos;
 		switch(c) {
 		case '\'':
 		case '"':
-			if (quote == 0) {
-				quote = c;
+			if (p->quote == 0) {
+				p->quote = c;
 				++pos;
-				if (pos == end)
-					return 0;
 				continue;
 			}
-			if (quote != c)
+			if (p->quote != c)
 				goto append_and_next;
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
+			return parse_token_end(p, TOKEN_TYPE_STR, pos + 1);
 		case '\\':
-			if (quote == '\'')
+			if (p->quote == '\'')
 				goto append_and_next;
-			if (quote == '"') {
+			if (pos + 1 == end)
+				goto need_more;
+			if (p->quote == '"') {
 				++pos;
-				if (pos == end)
-					return 0;
 				c = *pos;
 				switch (c)
 				{
@@ -186,13 +352,12 @@ parse_token(const char *pos, const char *end, struct token *out)
 				default:
 					break;
 				}
-				token_append(out, '\\');
+				/* Keep the backslash together with the char. */
+				token_append(p, out, pos - 1, 1);
 				goto append_and_next;
 			}
-			assert(quote == 0);
+			assert(p->quote == 0);
 			++pos;
-			if (pos == end)
-				return 0;
 			c = *pos;
 			if (c == '\n') {
 				++pos;
@@ -202,241 +367,309 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '&':
 		case '|':
 		case '>':
-			if (quote != 0)
+			if (p->quote != 0)
 				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
-			}
+			if (out->size > 0)
+				return parse_token_end(p, TOKEN_TYPE_STR, pos);
+			if (pos + 1 == end)
+				goto need_more;
 			++pos;
-			if (pos == end)
-				return 0;
 			if (*pos == c) {
 				switch(c) {
 				case '&':
-					out->type = TOKEN_TYPE_AND;
-					break;
+					return parse_token_end(p, TOKEN_TYPE_AND, pos + 1);
 				case '|':
-					out->type = TOKEN_TYPE_OR;
-					break;
+					return parse_token_end(p, TOKEN_TYPE_OR, pos + 1);
 				case '>':
-					out->type = TOKEN_TYPE_OUT_APPEND;
-					break;
-				default:
-					assert(false);
-					break;
-				}
-				++pos;
-			} else {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_BACKGROUND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_PIPE;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_NEW;
-					break;
+					return parse_token_end(p, TOKEN_TYPE_OUT_APPEND, pos + 1);
 				default:
 					assert(false);
 					break;
 				}
 			}
-			return pos - begin;
+			switch(c) {
+			case '&':
+				return parse_token_end(p, TOKEN_TYPE_BACKGROUND, pos);
+			case '|':
+				return parse_token_end(p, TOKEN_TYPE_PIPE, pos);
+			case '>':
+				return parse_token_end(p, TOKEN_TYPE_OUT_NEW, pos);
+			default:
+				assert(false);
+				break;
+			}
+			break;
 		case ' ':
 		case '\t':
 		case '\r':
-			if (quote != 0)
+			if (p->quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
+			if (out->size == 0) {
+				/* Whitespace after an escaped new line. */
+				++pos;
+				continue;
+			}
+			return parse_token_end(p, TOKEN_TYPE_STR, pos + 1);
 		case '\n':
-			if (quote != 0)
+			if (p->quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos - begin;
+			if (out->size == 0)
+				return parse_token_end(p, TOKEN_TYPE_NEW_LINE, pos + 1);
+			return parse_token_end(p, TOKEN_TYPE_STR, pos);
 		case '#':
-			if (quote != 0)
+			if (p->quote != 0)
 				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
+			if (out->size > 0)
+				return parse_token_end(p, TOKEN_TYPE_STR, pos);
+			p->is_in_comment = true;
+			const char *nl = memchr(pos + 1, '\n', end - pos - 1);
+			if (nl == NULL) {
+				pos = end;
+				goto need_more;
 			}
-			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
+			p->is_in_comment = false;
+			return parse_token_end(p, TOKEN_TYPE_NEW_LINE, nl + 1);
 		default:
 			goto append_and_next;
 		}
 	append_and_next:
-		token_append(out, c);
+		token_append(p, out, pos, 1);
 		++pos;
 	}
-	return 0;
+need_more:
+	p->pos = pos - parser_line(p);
+	return false;
 }
 
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
+static void
+parser_add_word(struct parser *p, const struct token *t)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
-	enum parser_error res = PARSER_ERR_NONE;
+	if (p->word_count == p->word_capacity) {
+		p->word_capacity = (p->word_capacity + 1) * 2;
+		p->words = realloc(p->words, sizeof(*p->words) * p->word_capacity);
+	}
+	p->words[p->word_count++] = *t;
+}
 
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		struct expr *e;
-		switch(token.type) {
-		case TOKEN_TYPE_STR:
-			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
-				continue;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->tail == NULL)
-				continue;
-			goto close_and_return;
-		case TOKEN_TYPE_PIPE:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_AND:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OR:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OUT_NEW:
-		case TOKEN_TYPE_OUT_APPEND:
-		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
-		default:
-			assert(false);
-		}
+static void
+parser_add_expr(struct parser *p, enum expr_type type)
+{
+	if (p->expr_count == p->expr_capacity) {
+		p->expr_capacity = (p->expr_capacity + 1) * 2;
+		p->exprs = realloc(p->exprs, sizeof(*p->exprs) * p->expr_capacity);
 	}
-	goto return_no_line;
+	struct expr_draft *e = &p->exprs[p->expr_count++];
+	e->type = type;
+	e->first_word = p->word_count;
+	e->word_count = 0;
+}
 
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
-		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+/** Type of the last expression, or -1 if there are none. */
+static inline int
+parser_tail_type(const struct parser *p)
+{
+	return p->expr_count == 0 ? -1 : (int)p->exprs[p->expr_count - 1].type;
+}
+
+/**
+ * Build the line from the parsed words and exprs. The line, the
+ * exprs, the arg arrays and the strings take one allocation.
+ */
+static struct command_line *
+parser_build_line(struct parser *p)
+{
+	const struct token *out_file = p->out_type != OUTPUT_TYPE_STDOUT ?
+				       &p->out_file : NULL;
+	uint32_t arg_count = p->word_count;
+	size_t text_size = 0;
+	for (uint32_t i = 0; i < p->word_count; ++i)
+		text_size += p->words[i].size + 1;
+	if (out_file != NULL)
+		text_size += out_file->size + 1;
+	for (uint32_t i = 0; i < p->expr_count; ++i) {
+		if (p->exprs[i].type == EXPR_TYPE_COMMAND)
+			--arg_count;
 	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+	size_t size = sizeof(struct command_line) +
+		      sizeof(struct expr) * p->expr_count +
+		      sizeof(char *) * arg_count + text_size;
+	struct command_line *line = malloc(size);
+	struct expr *exprs = (struct expr *)(line + 1);
+	char **args = (char **)(exprs + p->expr_count);
+	char *text = (char *)(args + arg_count);
+
+	line->head = p->expr_count > 0 ? exprs : NULL;
+	line->tail = p->expr_count > 0 ? &exprs[p->expr_count - 1] : NULL;
+	line->out_type = p->out_type;
+	line->out_file = NULL;
+	line->is_background = p->is_background;
+	if (out_file != NULL) {
+		memcpy(text, token_text(p, out_file), out_file->size);
+		text[out_file->size] = 0;
+		line->out_file = text;
+		text += out_file->size + 1;
 	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+	for (uint32_t i = 0; i < p->expr_count; ++i) {
+		const struct expr_draft *d = &p->exprs[i];
+		struct expr *e = &exprs[i];
+		memset(e, 0, sizeof(*e));
+		e->type = d->type;
+		e->next = i + 1 < p->expr_count ? &exprs[i + 1] : NULL;
+		if (d->type != EXPR_TYPE_COMMAND)
+			continue;
+		e->cmd.arg_count = d->word_count - 1;
+		e->cmd.arg_capacity = e->cmd.arg_count;
+		if (e->cmd.arg_count > 0)
+			e->cmd.args = args;
+		for (uint32_t j = 0; j < d->word_count; ++j) {
+			const struct token *t = &p->words[d->first_word + j];
+			memcpy(text, token_text(p, t), t->size);
+			text[t->size] = 0;
+			if (j == 0)
+				e->cmd.exe = text;
+			else
+				*args++ = text;
+			text += t->size + 1;
 		}
-		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
 	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
+	return line;
+}
 
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
-		}
+/** An operator needs a command on its left. */
+static enum parser_error
+parser_check_operator(const struct parser *p, enum parser_error no_left_arg,
+		      enum parser_error left_arg_not_a_command)
+{
+	if (p->expr_count == 0)
+		return no_left_arg;
+	if (parser_tail_type(p) != EXPR_TYPE_COMMAND)
+		return left_arg_not_a_command;
+	return PARSER_ERR_NONE;
+}
+
+/** Take a token of the commands part of the line. */
+static enum parser_error
+parser_take_command_token(struct parser *p, const struct token *t)
+{
+	enum parser_error res;
+	switch(t->type) {
+	case TOKEN_TYPE_STR:
+		if (parser_tail_type(p) != EXPR_TYPE_COMMAND)
+			parser_add_expr(p, EXPR_TYPE_COMMAND);
+		parser_add_word(p, t);
+		++p->exprs[p->expr_count - 1].word_count;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_PIPE:
+		res = parser_check_operator(p, PARSER_ERR_PIPE_WITH_NO_LEFT_ARG,
+			PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND);
+		if (res == PARSER_ERR_NONE)
+			parser_add_expr(p, EXPR_TYPE_PIPE);
+		return res;
+	case TOKEN_TYPE_AND:
+		res = parser_check_operator(p, PARSER_ERR_AND_WITH_NO_LEFT_ARG,
+			PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND);
+		if (res == PARSER_ERR_NONE)
+			parser_add_expr(p, EXPR_TYPE_AND);
+		return res;
+	case TOKEN_TYPE_OR:
+		res = parser_check_operator(p, PARSER_ERR_OR_WITH_NO_LEFT_ARG,
+			PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND);
+		if (res == PARSER_ERR_NONE)
+			parser_add_expr(p, EXPR_TYPE_OR);
+		return res;
+	case TOKEN_TYPE_OUT_NEW:
+		p->out_type = OUTPUT_TYPE_FILE_NEW;
+		p->state = PARSER_STATE_OUT_FILE;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_OUT_APPEND:
+		p->out_type = OUTPUT_TYPE_FILE_APPEND;
+		p->state = PARSER_STATE_OUT_FILE;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_BACKGROUND:
+		p->is_background = true;
+		p->state = PARSER_STATE_LINE_END;
+		return PARSER_ERR_NONE;
+	default:
+		assert(false);
+		return PARSER_ERR_NONE;
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
+}
 
-return_no_line:
-	command_line_delete(line);
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
 	*out = NULL;
-
-return_final:
-	free(token.data);
-	return res;
+	while (parse_token(p)) {
+		const struct token *t = &p->token;
+		enum parser_error res = PARSER_ERR_NONE;
+		if (t->type == TOKEN_TYPE_NEW_LINE) {
+			switch(p->state) {
+			case PARSER_STATE_COMMANDS:
+				/* Skip empty lines. */
+				if (p->expr_count == 0) {
+					parser_next_line(p);
+					continue;
+				}
+				break;
+			case PARSER_STATE_OUT_FILE:
+				/* Skipped together with the next line. */
+				p->error = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+				p->state = PARSER_STATE_SKIP;
+				continue;
+			case PARSER_STATE_LINE_END:
+				break;
+			case PARSER_STATE_SKIP:
+				res = p->error;
+				parser_next_line(p);
+				return res;
+			}
+			/* Also a redirect or '&' with no command at all. */
+			if (parser_tail_type(p) != EXPR_TYPE_COMMAND)
+				res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+			else
+				*out = parser_build_line(p);
+			parser_next_line(p);
+			return res;
+		}
+		switch(p->state) {
+		case PARSER_STATE_COMMANDS:
+			res = parser_take_command_token(p, t);
+			break;
+		case PARSER_STATE_OUT_FILE:
+			if (t->type != TOKEN_TYPE_STR) {
+				res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+				break;
+			}
+			p->out_file = *t;
+			p->state = PARSER_STATE_LINE_END;
+			break;
+		case PARSER_STATE_LINE_END:
+			if (t->type == TOKEN_TYPE_BACKGROUND && !p->is_background)
+				p->is_background = true;
+			else
+				res = PARSER_ERR_TOO_LATE_ARGUMENTS;
+			break;
+		case PARSER_STATE_SKIP:
+			break;
+		}
+		if (res != PARSER_ERR_NONE) {
+			/*
+			 * Skip the whole current line. It can't be executed
+			 * but can't just crash here because of that.
+			 */
+			p->error = res;
+			p->state = PARSER_STATE_SKIP;
+		}
+	}
+	return PARSER_ERR_NONE;
 }
 
 void
 parser_delete(struct parser *p)
 {
 	free(p->buffer);
+	free(p->scratch);
+	free(p->words);
+	free(p->exprs);
 	free(p);
 }
@@ -45,6 +45,10 @@ enum output_type {
 	OUTPUT_TYPE_FILE_APPEND,
 };
 
+/**
+ * A parsed line. It is a single allocation together with all its
+ * exprs, arg arrays and strings, freed by command_line_delete().
+ */
 struct command_line {
 	struct expr *head;
 	struct expr *tail;
@@ -0,0 +1,145 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Parser throughput on synthetic scripts: plain commands, heavy
+ * quoting, heavy escaping and long pipelines. Each script is parsed
+ * fed at once, as the script mode does, and by 1KB, as the input
+ * loop reads stdin. The line count is checked, so as a faster but
+ * broken parser does not pass for an optimization:
+ *
+ * $> make bench_parser
+ */
+
+enum {
+	BENCH_SCRIPT_SIZE = 16 << 20,
+	BENCH_REPEAT = 3,
+};
+
+struct script {
+	char *data;
+	uint32_t size;
+	uint32_t line_count;
+};
+
+typedef int (*line_f)(char *buf, uint32_t i);
+
+static int
+line_plain(char *buf, uint32_t i)
+{
+	return sprintf(buf, "grep -v pattern_%u file_%u.txt | sort -k 2 "
+		       "| uniq -c > out_%u.txt\n", i, i, i);
+}
+
+static int
+line_quoted(char *buf, uint32_t i)
+{
+	return sprintf(buf, "echo \"double \\\"quoted\\\" text %u\" "
+		       "'single quoted $HOME %u' mixed\"a b\"'c d'e "
+		       "\"spans\nlines # not a comment\" >> 'log %u.txt'\n",
+		       i, i, i);
+}
+
+static int
+line_escaped(char *buf, uint32_t i)
+{
+	return sprintf(buf, "cat my\\ file\\ %u.txt a\\\\b \\\"x\\\" \\'y\\' "
+		       "\\| \\& \\> \\\n| wc -l \\\n&& echo done_%u\n", i, i);
+}
+
+static int
+line_pipeline(char *buf, uint32_t i)
+{
+	int len = sprintf(buf, "cmd0 %u", i);
+	for (int j = 1; j < 32; ++j)
+		len += sprintf(buf + len, " | cmd%d -x %d", j, j);
+	len += sprintf(buf + len, " && ok || fail &\n");
+	return len;
+}
+
+static struct script
+script_new(line_f line)
+{
+	struct script s;
+	s.data = malloc(BENCH_SCRIPT_SIZE + 1024);
+	s.size = 0;
+	s.line_count = 0;
+	while (s.size < BENCH_SCRIPT_SIZE) {
+		s.size += line(s.data + s.size, s.line_count);
+		++s.line_count;
+	}
+	return s;
+}
+
+/** Parse the script by @a chunk bytes, returns the best seconds. */
+static double
+bench_parse(const struct script *s, uint32_t chunk)
+{
+	double best = 0;
+	for (int r = 0; r < BENCH_REPEAT; ++r) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		struct parser *p = parser_new();
+		uint32_t line_count = 0;
+		for (uint32_t pos = 0; pos < s->size; pos += chunk) {
+			uint32_t len = s->size - pos < chunk ? s->size - pos : chunk;
+			parser_feed(p, s->data + pos, len);
+			while (true) {
+				struct command_line *line = NULL;
+				enum parser_error err = parser_pop_next(p, &line);
+				if (err != PARSER_ERR_NONE) {
+					fprintf(stderr, "error %d\n", (int)err);
+					exit(1);
+				}
+				if (line == NULL)
+					break;
+				++line_count;
+				command_line_delete(line);
+			}
+		}
+		parser_delete(p);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (line_count != s->line_count) {
+			fprintf(stderr, "%u lines instead of %u\n", line_count,
+				s->line_count);
+			exit(1);
+		}
+		double sec = (end.tv_sec - start.tv_sec) +
+			     (end.tv_nsec - start.tv_nsec) / 1e9;
+		if (r == 0 || sec < best)
+			best = sec;
+	}
+	return best;
+}
+
+int
+main(void)
+{
+	struct {
+		const char *name;
+		line_f line;
+	} kinds[] = {
+		{"plain", line_plain},
+		{"quoted", line_quoted},
+		{"escaped", line_escaped},
+		{"pipeline", line_pipeline},
+	};
+	printf("%-10s %-7s %10s %12s\n", "script", "chunk", "MB/s",
+	       "lines/s");
+	for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); ++i) {
+		struct script s = script_new(kinds[i].line);
+		uint32_t chunks[] = {s.size, 1024};
+		for (int j = 0; j < 2; ++j) {
+			double sec = bench_parse(&s, chunks[j]);
+			printf("%-10s %-7s %10.1f %12.0f\n", kinds[i].name,
+			       j == 0 ? "whole" : "1KB",
+			       s.size / sec / (1 << 20), s.line_count / sec);
+		}
+		free(s.data);
+	}
+	return 0;
+}
@@ -0,0 +1,251 @@
+#include "parser.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Fuzz target of the parser. The data is parsed twice: fed at once,
+ * and fed by small chunks with a pop after each feed, as the shell
+ * reads its input. Both ways must give the same lines and errors,
+ * and each line must be well formed. Any mismatch aborts.
+ *
+ * With libFuzzer (clang):
+ * $> make fuzz && ./parser_fuzz fuzz_corpus/
+ *
+ * With -DPARSER_FUZZ_REPLAY the same target gets a main() which
+ * replays the given files, for example the crashes found by
+ * libFuzzer, or random inputs when there are no files:
+ * $> make fuzz_replay
+ * $> ./parser_fuzz_replay crash-1234 tests.txt
+ * $> ./parser_fuzz_replay -n 100000 -s 42
+ */
+
+#define fuzz_check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,	\
+			__LINE__, #cond);				\
+		abort();						\
+	}								\
+} while (0)
+
+/** Everything the parser returned, to compare two parses. */
+struct dump {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+dump_append(struct dump *d, const void *src, size_t len)
+{
+	if (d->capacity - d->size < len) {
+		size_t new_capacity = (d->capacity + 1) * 2;
+		if (new_capacity - d->size < len)
+			new_capacity = d->size + len;
+		d->data = realloc(d->data, new_capacity);
+		d->capacity = new_capacity;
+	}
+	memcpy(d->data + d->size, src, len);
+	d->size += len;
+}
+
+static void
+dump_str(struct dump *d, const char *str)
+{
+	/* With the terminating zero, so as "a" "b" differs from "ab". */
+	dump_append(d, str, strlen(str) + 1);
+}
+
+static void
+dump_int(struct dump *d, int value)
+{
+	dump_append(d, &value, sizeof(value));
+}
+
+/** Check the line is well formed and append it to the dump. */
+static void
+dump_line(struct dump *d, const struct command_line *line)
+{
+	fuzz_check(line->head != NULL && line->tail != NULL);
+	fuzz_check((line->out_type == OUTPUT_TYPE_STDOUT) ==
+		   (line->out_file == NULL));
+	fuzz_check(line->tail->type == EXPR_TYPE_COMMAND);
+	dump_int(d, line->out_type);
+	dump_int(d, line->is_background);
+	if (line->out_file != NULL)
+		dump_str(d, line->out_file);
+	enum expr_type prev = EXPR_TYPE_PIPE;
+	const struct expr *last = NULL;
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		/* Commands and operators alternate. */
+		fuzz_check((prev == EXPR_TYPE_COMMAND) !=
+			   (e->type == EXPR_TYPE_COMMAND));
+		prev = e->type;
+		last = e;
+		dump_int(d, e->type);
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		fuzz_check(e->cmd.exe != NULL);
+		fuzz_check(e->cmd.arg_count == 0 || e->cmd.args != NULL);
+		dump_str(d, e->cmd.exe);
+		dump_int(d, e->cmd.arg_count);
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+			fuzz_check(e->cmd.args[i] != NULL);
+			dump_str(d, e->cmd.args[i]);
+		}
+	}
+	fuzz_check(last == line->tail);
+}
+
+/** Pop all the complete lines. */
+static void
+dump_pop_all(struct dump *d, struct parser *p)
+{
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			fuzz_check(line == NULL);
+			dump_int(d, -(int)err);
+			continue;
+		}
+		if (line == NULL)
+			break;
+		dump_line(d, line);
+		command_line_delete(line);
+	}
+}
+
+/**
+ * The chunk sizes are pseudo-random, taken from the data itself, so
+ * as a replayed input is cut the same way as when it was found.
+ */
+static uint32_t
+fuzz_seed(const uint8_t *data, size_t size)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < size; ++i)
+		h = (h ^ data[i]) * 16777619u;
+	return h;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	const char *str = (const char *)data;
+	struct dump whole = {NULL, 0, 0};
+	struct dump chunked = {NULL, 0, 0};
+
+	struct parser *p = parser_new();
+	parser_feed(p, str, size);
+	/* The last line is finished for both parses. */
+	parser_feed(p, "\n", 1);
+	dump_pop_all(&whole, p);
+	parser_delete(p);
+
+	p = parser_new();
+	uint32_t seed = fuzz_seed(data, size);
+	size_t pos = 0;
+	while (pos < size) {
+		seed = seed * 1103515245u + 12345u;
+		/* Mostly tiny chunks, to cut tokens anywhere. */
+		size_t len = 1 + (seed >> 16) % ((seed & 0x8000) ? 4 : 64);
+		if (len > size - pos)
+			len = size - pos;
+		parser_feed(p, str + pos, len);
+		dump_pop_all(&chunked, p);
+		pos += len;
+	}
+	parser_feed(p, "\n", 1);
+	dump_pop_all(&chunked, p);
+	parser_delete(p);
+
+	fuzz_check(whole.size == chunked.size);
+	fuzz_check(whole.size == 0 ||
+		   memcmp(whole.data, chunked.data, whole.size) == 0);
+	free(whole.data);
+	free(chunked.data);
+	return 0;
+}
+
+#ifdef PARSER_FUZZ_REPLAY
+
+#include <unistd.h>
+
+static int
+replay_file(const char *name)
+{
+	FILE *f = fopen(name, "rb");
+	if (f == NULL) {
+		perror(name);
+		return -1;
+	}
+	struct dump d = {NULL, 0, 0};
+	char buf[4096];
+	size_t rc;
+	while ((rc = fread(buf, 1, sizeof(buf), f)) > 0)
+		dump_append(&d, buf, rc);
+	fclose(f);
+	LLVMFuzzerTestOneInput((const uint8_t *)d.data, d.size);
+	free(d.data);
+	return 0;
+}
+
+/** Random inputs made mostly of the chars the parser cares about. */
+static void
+replay_random(uint32_t count, uint32_t seed)
+{
+	static const char alphabet[] = "ab c\"'\\\n|&>#\t \r xyz0123";
+	srand(seed);
+	uint8_t buf[4096];
+	for (uint32_t i = 0; i < count; ++i) {
+		size_t size = rand() % sizeof(buf);
+		for (size_t j = 0; j < size; ++j) {
+			int r = rand() % 100;
+			if (r < 50)
+				buf[j] = 'a' + rand() % 26;
+			else if (r < 99)
+				buf[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+			else
+				buf[j] = rand() % 256;
+		}
+		LLVMFuzzerTestOneInput(buf, size);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t count = 10000;
+	uint32_t seed = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch(opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n count] [-s seed] "
+				"[file...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind == argc) {
+		replay_random(count, seed);
+		printf("%u random inputs, seed %u: ok\n", count, seed);
+		return 0;
+	}
+	for (int i = optind; i < argc; ++i) {
+		if (replay_file(argv[i]) != 0)
+			return 1;
+		printf("%s: ok\n", argv[i]);
+	}
+	return 0;
+}
+
+#endif
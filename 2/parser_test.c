@@ -2,7 +2,9 @@
 
 #include "unit.h"
 
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 static void
 test_one_word(void)
@@ -819,6 +821,134 @@ test_errors(void)
 	unit_test_finish();
 }
 
+static void
+test_long_words(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	unit_msg("Words longer than a vector block");
+	const char *str = "command_with_a_long_name first_argument_is_long"
+		" mixed_'quoted part 'and\\ escape_\\\"in\\\"_the_middle"
+		" \"last argument ends the line\"\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "command_with_a_long_name") == 0, "exe");
+	unit_check(e->cmd.arg_count == 4, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "first_argument_is_long") == 0,
+		   "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "mixed_quoted part ") == 0,
+		   "arg[1]");
+	unit_check(strcmp(e->cmd.args[2], "and escape_\"in\"_the_middle") == 0,
+		   "arg[2]");
+	unit_check(strcmp(e->cmd.args[3], "last argument ends the line") == 0,
+		   "arg[3]");
+	command_line_delete(line);
+
+	unit_msg("Many words");
+	char buf[16 * 1024];
+	uint32_t len = 0;
+	for (int i = 0; i < 1000; ++i)
+		len += sprintf(buf + len, "word%d ", i);
+	buf[len++] = '\n';
+	/* Fed by parts, so words are cut in the middle. */
+	for (uint32_t pos = 0; pos < len; pos += 1000) {
+		uint32_t size = len - pos < 1000 ? len - pos : 1000;
+		parser_feed(p, buf + pos, size);
+	}
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(strcmp(e->cmd.exe, "word0") == 0, "exe");
+	unit_check(e->cmd.arg_count == 999, "arg count");
+	unit_check(strcmp(e->cmd.args[998], "word999") == 0, "last arg");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+/**
+ * Feed a line of @a size bytes by @a chunk bytes, popping after
+ * each feed as the shell does. The parsed line goes to @a res.
+ * Returns the time in seconds.
+ */
+static double
+bench_long_line(const char *line, uint32_t size, uint32_t chunk,
+		struct command_line **res)
+{
+	struct parser *p = parser_new();
+	struct timespec start, end;
+	*res = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (uint32_t pos = 0; pos < size; pos += chunk) {
+		uint32_t len = size - pos < chunk ? size - pos : chunk;
+		parser_feed(p, line + pos, len);
+		unit_fail_if(parser_pop_next(p, res) != PARSER_ERR_NONE);
+		if (pos + len < size)
+			unit_fail_if(*res != NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	parser_delete(p);
+	return (end.tv_sec - start.tv_sec) +
+	       (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void
+test_long_line_by_chunks(void)
+{
+	unit_test_start();
+
+	/*
+	 * The parser keeps its state between feeds, so the time must
+	 * not depend on the chunk size much. A parser reading the line
+	 * from its begin after each feed is quadratic here.
+	 */
+	const uint32_t size = 1 << 20;
+	char *line = malloc(size + 64);
+	uint32_t len = 0;
+	uint32_t arg_count = 0;
+	len += sprintf(line, "exe");
+	while (len < size) {
+		switch (arg_count % 3) {
+		case 0:
+			len += sprintf(line + len, " plain_word_%u", arg_count);
+			break;
+		case 1:
+			len += sprintf(line + len, " 'single %u'", arg_count);
+			break;
+		default:
+			len += sprintf(line + len, " esc\\ aped\\\n%u",
+				       arg_count);
+			break;
+		}
+		++arg_count;
+	}
+	len += sprintf(line + len, " \"a \\\"quoted\\\" end\"\n");
+	++arg_count;
+
+	uint32_t chunks[] = {len, 4096, 64, 1};
+	for (uint32_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+		struct command_line *res;
+		double sec = bench_long_line(line, len, chunks[i], &res);
+		unit_msg("%u bytes by %u: %.3f ms, %.1f MB/s", len, chunks[i],
+			 sec * 1e3, len / sec / (1 << 20));
+		unit_check(res != NULL, "line is parsed");
+		const struct expr *e = res->head;
+		unit_check(e == res->tail && e->type == EXPR_TYPE_COMMAND,
+			   "one command");
+		unit_check(strcmp(e->cmd.exe, "exe") == 0, "exe");
+		unit_check(e->cmd.arg_count == arg_count, "arg count");
+		unit_check(strcmp(e->cmd.args[arg_count - 1],
+				  "a \"quoted\" end") == 0, "last arg");
+		command_line_delete(res);
+	}
+	free(line);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -834,5 +964,7 @@ main(void)
 	test_logical_operators();
 	test_background();
 	test_errors();
+	test_long_words();
+	test_long_line_by_chunks();
 	return 0;
 }
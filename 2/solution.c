@@ -1,273 +1,1459 @@
+#define _GNU_SOURCE
 #include "parser.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <spawn.h>
 
-void initialize_pipes(int *pipes_count, int **fd)
+extern char **environ;
+
+/**
+ * Cache of PATH lookups, so as a script running the same commands
+ * over and over does not make execvp() try each PATH directory
+ * every time. Only absolute paths are cached - relative PATH
+ * entries depend on the current directory. Misses are not cached,
+ * because the file can appear later.
+ */
+struct path_cache_entry
+{
+	char *name;
+	char *path;
+	uint32_t hash;
+};
+
+struct path_cache
+{
+	struct path_cache_entry *entries;
+	uint32_t capacity;
+	uint32_t count;
+};
+
+/** A background job, see job_start(). */
+struct job
+{
+	int id;
+	pid_t pid;
+	/** -1 if the kernel has no pidfd_open(). */
+	int pidfd;
+};
+
+struct job_table
+{
+	struct job *jobs;
+	uint32_t count;
+	uint32_t capacity;
+	int next_id;
+};
+
+/**
+ * What the shell keeps between the lines. It is owned by main() and
+ * passed down to the execution, so as there are no globals.
+ */
+struct shell_state
+{
+	struct path_cache path_cache;
+	/** Processes started by the shell, reported by the -t mode. */
+	long long process_count;
+	/** Size of the pipes between stages, set by -p. 0 is the default. */
+	int pipe_size;
+	/** Background jobs which are not reaped yet. */
+	struct job_table job_table;
+	/**
+	 * In a background job - the pipe to tell the shell that the first
+	 * pipeline is started. -1 after that, and in the shell itself.
+	 */
+	int job_started_fd;
+	/** Report the resources of each stage of every pipeline, set by -T. */
+	bool is_time_all;
+	/**
+	 * One epoll for the stages of all pipelines, so as waiting for a
+	 * pipeline costs no epoll_create(). Created on the first use.
+	 */
+	int stage_epoll_fd;
+};
+
+static uint32_t
+path_cache_hash(const char *name)
 {
-	for (int i = 0; i < *pipes_count; i++)
+	/* FNV-1a. */
+	uint32_t hash = 2166136261u;
+	for (; *name != 0; ++name)
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	return hash;
+}
+
+/** Find the entry of the name, or the empty slot for it. */
+static struct path_cache_entry *
+path_cache_find(struct path_cache *cache, const char *name, uint32_t hash)
+{
+	uint32_t mask = cache->capacity - 1;
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask)
 	{
-		fd[i] = (int *)&fd[*pipes_count] + i * 2;
-		pipe(fd[i]);
+		struct path_cache_entry *e = &cache->entries[i];
+		if (e->name == NULL || (e->hash == hash && strcmp(e->name, name) == 0))
+			return e;
 	}
 }
 
-void count_pipes(const struct expr *e, int *pipes_count)
+static void
+path_cache_grow(struct path_cache *cache)
 {
-	while (e != NULL)
+	struct path_cache old = *cache;
+	cache->capacity = old.capacity == 0 ? 64 : old.capacity * 2;
+	cache->entries = calloc(cache->capacity, sizeof(*cache->entries));
+	for (uint32_t i = 0; i < old.capacity; ++i)
+	{
+		struct path_cache_entry *e = &old.entries[i];
+		if (e->name != NULL)
+			*path_cache_find(cache, e->name, e->hash) = *e;
+	}
+	free(old.entries);
+}
+
+/**
+ * Full path of the executable as execvp() would find it, or NULL
+ * if execvp() should search by itself.
+ */
+static const char *
+path_cache_resolve(struct path_cache *cache, const char *name)
+{
+	if (strchr(name, '/') != NULL || *name == 0)
+		return NULL;
+	uint32_t hash = path_cache_hash(name);
+	if (cache->capacity > 0)
+	{
+		struct path_cache_entry *e = path_cache_find(cache, name, hash);
+		if (e->name != NULL)
+			return e->path;
+	}
+	const char *dirs = getenv("PATH");
+	if (dirs == NULL)
+		return NULL;
+	size_t name_len = strlen(name);
+	while (*dirs != 0)
 	{
-		if (e->type == EXPR_TYPE_PIPE)
+		const char *end = strchr(dirs, ':');
+		if (end == NULL)
+			end = dirs + strlen(dirs);
+		size_t dir_len = end - dirs;
+		if (dir_len > 0 && *dirs == '/')
+		{
+			char *path = malloc(dir_len + name_len + 2);
+			memcpy(path, dirs, dir_len);
+			path[dir_len] = '/';
+			memcpy(path + dir_len + 1, name, name_len + 1);
+			struct stat st;
+			if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+			{
+				if ((cache->count + 1) * 2 > cache->capacity)
+					path_cache_grow(cache);
+				struct path_cache_entry *e = path_cache_find(cache, name, hash);
+				e->name = strdup(name);
+				e->path = path;
+				e->hash = hash;
+				++cache->count;
+				return path;
+			}
+			free(path);
+		}
+		else if (dir_len == 0 || *dirs != '/')
 		{
-			*pipes_count += 1;
+			/* A relative directory goes first - let execvp() decide. */
+			return NULL;
 		}
-		e = e->next;
+		dirs = *end == ':' ? end + 1 : end;
 	}
+	return NULL;
 }
 
-int handle_exit_cmd(char *cmd, int *exit_status)
+static void
+path_cache_destroy(struct path_cache *cache)
 {
-	if (strcmp(cmd, "exit") == 0)
+	for (uint32_t i = 0; i < cache->capacity; ++i)
 	{
-		*exit_status = 1;
-		return 1;
+		free(cache->entries[i].name);
+		free(cache->entries[i].path);
+	}
+	free(cache->entries);
+	memset(cache, 0, sizeof(*cache));
+}
+
+static void
+job_notify_started(struct shell_state *shell)
+{
+	if (shell->job_started_fd >= 0)
+	{
+		close(shell->job_started_fd);
+		shell->job_started_fd = -1;
 	}
+}
+
+/*
+ * Builtins are run by the shell itself, without exec. A builtin
+ * stage runs right in the shell process when it can't block the
+ * pipeline: when it is the last stage, or its output surely fits
+ * into the pipe to the next stage. Otherwise it runs in a forked
+ * child, which still saves the exec and the dynamic loading.
+ */
+
+struct builtin
+{
+	const char *name;
+	/** Run with the stage's stdin and stdout. Returns the exit status. */
+	int (*run)(const struct command *cmd, int in_fd, int out_fd);
+	/**
+	 * Upper bound of the output size. NULL if it depends on the
+	 * input or is unlimited.
+	 */
+	size_t (*output_size)(const struct command *cmd);
+	/** False if the arguments are not supported, so exec is needed. */
+	bool (*is_supported)(const struct command *cmd);
+};
 
+static size_t
+builtin_no_output(const struct command *cmd)
+{
+	(void)cmd;
 	return 0;
 }
 
-void free_cmd_atributes(int** fd, int* child_pid){
-	free(fd);
-	free(child_pid);
+/** exit inside a pipeline ends only its own stage. */
+static int
+builtin_exit(const struct command *cmd, int in_fd, int out_fd)
+{
+	(void)in_fd;
+	(void)out_fd;
+	return cmd->arg_count > 0 ? atoi(cmd->args[0]) & 0xff : 0;
 }
 
-int execute_command(const struct expr *e, const struct command_line *line, int **fd, int *child_pid, int pipes_count, int cmd_id)
+/**
+ * cd which is a whole pipeline changes the directory of the shell
+ * itself, also inside && and ||.
+ */
+static int
+shell_cd(const struct command *cmd)
 {
-	char *argv[e->cmd.arg_count + 2];
-	argv[0] = e->cmd.exe;
-	for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+	const char *dir = cmd->arg_count > 0 ? cmd->args[0] : getenv("HOME");
+	if (dir == NULL || chdir(dir) != 0)
 	{
-		argv[i + 1] = e->cmd.args[i];
+		printf("bash: %s: out: No such file or directory\n", cmd->exe);
+		/* Before the output of the next commands. */
+		fflush(stdout);
+		return 1;
 	}
-	argv[e->cmd.arg_count + 2 - 1] = NULL;
+	return 0;
+}
 
-	int exit_flag = 0;
+/** cd inside a pipeline does not change the shell's directory. */
+static int
+builtin_cd(const struct command *cmd, int in_fd, int out_fd)
+{
+	(void)cmd;
+	(void)in_fd;
+	(void)out_fd;
+	return 0;
+}
 
-	if (strcmp(e->cmd.exe, "cd") == 0)
-	{
-		if (pipes_count == 0)
-		{	
-			int error = chdir(argv[1]);
-			if (error != 0)
-				printf("bash: %s: out: No such file or directory\n", e->cmd.exe);
-		}
+#ifndef SHELL_NO_BUILTINS
 
-		return 0;
+static int
+write_all(int fd, const char *buf, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t rc = write(fd, buf, size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return -1;
+		buf += rc;
+		size -= rc;
 	}
+	return 0;
+}
+
+static int
+builtin_true(const struct command *cmd, int in_fd, int out_fd)
+{
+	(void)cmd;
+	(void)in_fd;
+	(void)out_fd;
+	return 0;
+}
+
+static int
+builtin_false(const struct command *cmd, int in_fd, int out_fd)
+{
+	(void)cmd;
+	(void)in_fd;
+	(void)out_fd;
+	return 1;
+}
 
-	if (strcmp(e->cmd.exe, "exit") == 0)
+/** How many leading args of echo are options like -n, -e, -E. */
+static uint32_t
+echo_parse_options(const struct command *cmd, bool *is_newline, bool *is_escaped)
+{
+	*is_newline = true;
+	*is_escaped = false;
+	uint32_t i = 0;
+	for (; i < cmd->arg_count; ++i)
 	{
-		if (pipes_count == 0)
-		{	
-			return 1;
+		const char *arg = cmd->args[i];
+		if (arg[0] != '-' || arg[1] == 0 || strspn(arg + 1, "neE") != strlen(arg + 1))
+			break;
+		for (++arg; *arg != 0; ++arg)
+		{
+			if (*arg == 'n')
+				*is_newline = false;
+			else
+				*is_escaped = *arg == 'e';
 		}
-
-		exit_flag = 1;
 	}
+	return i;
+}
 
-	if (strcmp(e->cmd.exe, "#") == 0){
-		return 2;
-	}
+static size_t
+echo_output_size(const struct command *cmd)
+{
+	/* Escapes only make the text shorter. */
+	size_t size = 1;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i)
+		size += strlen(cmd->args[i]) + 1;
+	return size;
+}
 
-	int pid = fork();
-	if (pid == 0)
+/**
+ * Append the arg with echo -e escapes resolved. Returns false if
+ * \c was met and the output must stop.
+ */
+static bool
+echo_unescape(const char *arg, char **out)
+{
+	char *pos = *out;
+	while (*arg != 0)
 	{
-		if (cmd_id > 0)
+		char c = *arg++;
+		if (c != '\\' || *arg == 0)
+		{
+			*pos++ = c;
+			continue;
+		}
+		c = *arg++;
+		switch (c)
+		{
+		case 'a': *pos++ = '\a'; break;
+		case 'b': *pos++ = '\b'; break;
+		case 'e': *pos++ = 033; break;
+		case 'f': *pos++ = '\f'; break;
+		case 'n': *pos++ = '\n'; break;
+		case 'r': *pos++ = '\r'; break;
+		case 't': *pos++ = '\t'; break;
+		case 'v': *pos++ = '\v'; break;
+		case '\\': *pos++ = '\\'; break;
+		case 'c':
+			*out = pos;
+			return false;
+		case '0':
+		{
+			int value = 0;
+			for (int i = 0; i < 3 && *arg >= '0' && *arg <= '7'; ++i)
+				value = value * 8 + *arg++ - '0';
+			*pos++ = (char)value;
+			break;
+		}
+		case 'x':
 		{
-			int new_fd = dup2(fd[cmd_id - 1][0], STDIN_FILENO);
-			if (new_fd == -1)
+			int value = 0;
+			int i = 0;
+			for (; i < 2 && isxdigit((unsigned char)*arg); ++i, ++arg)
+				value = value * 16 + (isdigit((unsigned char)*arg) ? *arg - '0' : (*arg | 0x20) - 'a' + 10);
+			if (i == 0)
 			{
-				perror("dup2");
-				exit(EXIT_FAILURE);
+				*pos++ = '\\';
+				*pos++ = 'x';
 			}
-		}
-
-		if (cmd_id < pipes_count)
-		{	
-			int new_fd = dup2(fd[cmd_id][1], STDOUT_FILENO);
-			if (new_fd == -1)
+			else
 			{
-				perror("dup2");
-				exit(EXIT_FAILURE);
+				*pos++ = (char)value;
 			}
+			break;
 		}
+		default:
+			*pos++ = '\\';
+			*pos++ = c;
+			break;
+		}
+	}
+	*out = pos;
+	return true;
+}
 
-		if (cmd_id == pipes_count) {
-			int new_fd;
-			if (line->out_type == OUTPUT_TYPE_FILE_NEW){
-				int file = open(line->out_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-				new_fd = dup2(file, STDOUT_FILENO);
-				close(file);
-			} else if (line->out_type == OUTPUT_TYPE_FILE_APPEND){
-				int file = open(line->out_file, O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
-				new_fd = dup2(file, STDOUT_FILENO);
-				close(file);
-			}
-
-			if (new_fd == -1)
-			{
-				perror("dup2");
-				exit(EXIT_FAILURE);
-			}
+/** Like coreutils echo: -n, -e and -E are supported. */
+static int
+builtin_echo(const struct command *cmd, int in_fd, int out_fd)
+{
+	(void)in_fd;
+	bool is_newline, is_escaped;
+	uint32_t first = echo_parse_options(cmd, &is_newline, &is_escaped);
+	size_t capacity = echo_output_size(cmd);
+	char small[4096];
+	char *buf = capacity <= sizeof(small) ? small : malloc(capacity);
+	char *pos = buf;
+	for (uint32_t i = first; i < cmd->arg_count; ++i)
+	{
+		if (i > first)
+			*pos++ = ' ';
+		if (!is_escaped)
+		{
+			size_t len = strlen(cmd->args[i]);
+			memcpy(pos, cmd->args[i], len);
+			pos += len;
+		}
+		else if (!echo_unescape(cmd->args[i], &pos))
+		{
+			is_newline = false;
+			break;
+		}
+	}
+	if (is_newline)
+		*pos++ = '\n';
+	int rc = write_all(out_fd, buf, pos - buf);
+	if (buf != small)
+		free(buf);
+	return rc == 0 ? 0 : 1;
+}
 
+/** Repeat the line until the reader is gone. */
+static int
+builtin_yes(const struct command *cmd, int in_fd, int out_fd)
+{
+	(void)in_fd;
+	size_t line_size = cmd->arg_count == 0 ? 2 : echo_output_size(cmd) - 1;
+	size_t capacity = line_size > 8192 ? line_size : 8192;
+	char *buf = malloc(capacity);
+	char *pos = buf;
+	if (cmd->arg_count == 0)
+	{
+		memcpy(pos, "y\n", 2);
+	}
+	else
+	{
+		for (uint32_t i = 0; i < cmd->arg_count; ++i)
+		{
+			size_t len = strlen(cmd->args[i]);
+			memcpy(pos, cmd->args[i], len);
+			pos += len;
+			*pos++ = i + 1 < cmd->arg_count ? ' ' : '\n';
 		}
+	}
+	/* Fill the buffer with whole lines, to write less often. */
+	size_t size = line_size;
+	while (size + line_size <= capacity)
+	{
+		memcpy(buf + size, buf, line_size);
+		size += line_size;
+	}
+	/*
+	 * The buffer never changes, so the pipe can take references to
+	 * its pages instead of a copy of them on each write.
+	 */
+	struct iovec iov = {buf, size};
+	while (true)
+	{
+		ssize_t rc = vmsplice(out_fd, &iov, 1, 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			break;
+		iov.iov_base = (char *)iov.iov_base + rc;
+		iov.iov_len -= rc;
+		if (iov.iov_len == 0)
+		{
+			iov.iov_base = buf;
+			iov.iov_len = size;
+		}
+	}
+	/* Not a pipe. */
+	if (errno == EBADF || errno == EINVAL)
+	{
+		while (write_all(out_fd, buf, size) == 0)
+			;
+	}
+	free(buf);
+	return 1;
+}
 
-		for (int j = 0; j < pipes_count; j++)
+/**
+ * Copy all the data. splice() moves it between a pipe and another
+ * fd inside the kernel, sendfile() - from a file to any fd. Other
+ * fds are copied via a buffer.
+ */
+static int
+cat_copy(int in_fd, int out_fd)
+{
+	while (true)
+	{
+		ssize_t rc = splice(in_fd, NULL, out_fd, NULL, 1 << 16, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (rc == 0)
+			return 0;
+		if (rc > 0)
+			continue;
+		if (errno == EINTR)
+			continue;
+		if (errno != EINVAL)
+			return -1;
+		break;
+	}
+	while (true)
+	{
+		ssize_t rc = sendfile(out_fd, in_fd, NULL, 1 << 30);
+		if (rc == 0)
+			return 0;
+		if (rc > 0)
+			continue;
+		if (errno == EINTR)
+			continue;
+		if (errno != EINVAL && errno != ENOSYS)
+			return -1;
+		break;
+	}
+	char buf[1 << 16];
+	ssize_t rc;
+	while ((rc = read(in_fd, buf, sizeof(buf))) != 0)
+	{
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 || write_all(out_fd, buf, rc) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static bool
+cat_is_supported(const struct command *cmd)
+{
+	/* Options like -s are left to the real cat. */
+	for (uint32_t i = 0; i < cmd->arg_count; ++i)
+	{
+		if (cmd->args[i][0] == '-' && cmd->args[i][1] != 0)
+			return false;
+	}
+	return true;
+}
+
+static int
+builtin_cat(const struct command *cmd, int in_fd, int out_fd)
+{
+	if (cmd->arg_count == 0)
+		return cat_copy(in_fd, out_fd) == 0 ? 0 : 1;
+	int status = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i)
+	{
+		const char *name = cmd->args[i];
+		if (strcmp(name, "-") == 0)
+		{
+			if (cat_copy(in_fd, out_fd) != 0)
+				status = 1;
+			continue;
+		}
+		int fd = open(name, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
 		{
-			close(fd[j][0]);
-			close(fd[j][1]);
+			fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+			status = 1;
+			continue;
 		}
+		if (cat_copy(fd, out_fd) != 0)
+			status = 1;
+		close(fd);
+	}
+	return status;
+}
+
+/**
+ * Move the pipe data to a file. splice() can move less than asked,
+ * when the file is short of space for example.
+ */
+static int
+tee_splice_all(int in_fd, int out_fd, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t rc = splice(in_fd, NULL, out_fd, NULL, size, SPLICE_F_MOVE);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+		size -= rc;
+	}
+	return 0;
+}
 
-		if (exit_flag == 1){
-			execlp("sh", "sh", "-c", "exit", NULL);
+/**
+ * Copy the input to the output and the files via a buffer. Used
+ * when the fds are not pipes, or there are several files.
+ */
+static int
+tee_copy(int in_fd, int out_fd, const int *fds, uint32_t fd_count)
+{
+	char buf[1 << 16];
+	int status = 0;
+	ssize_t rc;
+	while ((rc = read(in_fd, buf, sizeof(buf))) != 0)
+	{
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 || write_all(out_fd, buf, rc) != 0)
+			return 1;
+		for (uint32_t i = 0; i < fd_count; ++i)
+		{
+			if (fds[i] >= 0 && write_all(fds[i], buf, rc) != 0)
+				status = 1;
 		}
+	}
+	return status;
+}
+
+static bool
+tee_is_supported(const struct command *cmd)
+{
+	/* -a and -i are left to the real tee. */
+	for (uint32_t i = 0; i < cmd->arg_count; ++i)
+	{
+		if (cmd->args[i][0] == '-')
+			return false;
+	}
+	return true;
+}
 
-		int error = execvp(e->cmd.exe, argv);
-		if (error != 0)
+/**
+ * With one file and pipes on both sides the data is not copied at
+ * all: tee() duplicates the pages into the output pipe without
+ * consuming them, then splice() moves the same pages to the file.
+ */
+static int
+builtin_tee(const struct command *cmd, int in_fd, int out_fd)
+{
+	int status = 0;
+	int fds[cmd->arg_count + 1];
+	for (uint32_t i = 0; i < cmd->arg_count; ++i)
+	{
+		const char *name = cmd->args[i];
+		fds[i] = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fds[i] < 0)
 		{
-			// fprintf(stderr, "exec %d", error);
-			exit(error);
+			fprintf(stderr, "tee: %s: %s\n", name, strerror(errno));
+			status = 1;
 		}
 	}
-	else if (pid > 0)
+	if (cmd->arg_count == 0)
 	{
-		child_pid[cmd_id] = pid;
+		status = cat_copy(in_fd, out_fd) == 0 ? 0 : 1;
 	}
-	else if (pid == -1)
+	else if (cmd->arg_count == 1 && fds[0] >= 0)
 	{
+		bool is_pipe = true;
+		while (true)
+		{
+			ssize_t rc = tee(in_fd, out_fd, 1 << 16, 0);
+			if (rc == 0)
+				break;
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc < 0)
+			{
+				/* Nothing is consumed yet, can fall back. */
+				if (errno == EINVAL && is_pipe)
+					status = tee_copy(in_fd, out_fd, fds, 1);
+				else
+					status = 1;
+				break;
+			}
+			is_pipe = false;
+			if (tee_splice_all(in_fd, fds[0], rc) != 0)
+			{
+				fprintf(stderr, "tee: %s: %s\n", cmd->args[0], strerror(errno));
+				status = 1;
+				break;
+			}
+		}
+	}
+	else
+	{
+		if (tee_copy(in_fd, out_fd, fds, cmd->arg_count) != 0)
+			status = 1;
 	}
+	for (uint32_t i = 0; i < cmd->arg_count; ++i)
+	{
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	return status;
+}
 
-	return 0;
+#endif /* SHELL_NO_BUILTINS */
+
+static const struct builtin builtins[] = {
+	{"cd", builtin_cd, builtin_no_output, NULL},
+	{"exit", builtin_exit, builtin_no_output, NULL},
+#ifndef SHELL_NO_BUILTINS
+	{"true", builtin_true, builtin_no_output, NULL},
+	{"false", builtin_false, builtin_no_output, NULL},
+	{"echo", builtin_echo, echo_output_size, NULL},
+	{"yes", builtin_yes, NULL, NULL},
+	{"cat", builtin_cat, NULL, cat_is_supported},
+	{"tee", builtin_tee, NULL, tee_is_supported},
+#endif
+};
+
+static const struct builtin *
+builtin_find(const struct command *cmd)
+{
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i)
+	{
+		const struct builtin *b = &builtins[i];
+		if (strcmp(b->name, cmd->exe) == 0)
+			return b->is_supported == NULL || b->is_supported(cmd) ? b : NULL;
+	}
+	return NULL;
 }
 
-static void
-execute_command_line(const struct command_line *line, int* exit_status)
+/** Exit status of a waited process, the way shells report it. */
+static int
+wait_status(int wstatus)
 {
-	/* REPLACE THIS CODE WITH ACTUAL COMMAND EXECUTION */
+	if (WIFEXITED(wstatus))
+		return WEXITSTATUS(wstatus);
+	if (WIFSIGNALED(wstatus))
+		return 128 + WTERMSIG(wstatus);
+	return 1;
+}
 
-	assert(line != NULL);
-	// printf("================================\n");
-	// printf("Command line:\n");
-	// printf("Is background: %d\n", (int)line->is_background);
-	// printf("Output: "); 
-	if (line->out_type == OUTPUT_TYPE_STDOUT)
+/** Make @a fd the @a target fd of a forked child. */
+static void
+child_move_fd(int fd, int target)
+{
+	if (fd == target)
+		return;
+	if (dup2(fd, target) == -1)
 	{
-		// printf("stdout\n");
-
+		perror("dup2");
+		_exit(EXIT_FAILURE);
 	}
-	else if (line->out_type == OUTPUT_TYPE_FILE_NEW)
+	close(fd);
+}
+
+/**
+ * Run a builtin stage in a forked child, without exec. @a next_fd
+ * is the read end of the pipe to the next stage - the child must
+ * not keep it, or it would never get EPIPE.
+ */
+static pid_t
+fork_builtin(struct shell_state *shell, const struct builtin *b, const struct command *cmd, int in_fd, int out_fd,
+	     int next_fd)
+{
+	++shell->process_count;
+	pid_t pid = fork();
+	if (pid == 0)
 	{
-		// printf("new file - \"%s\"\n", line->out_file);
+		signal(SIGPIPE, SIG_DFL);
+		if (next_fd >= 0)
+			close(next_fd);
+		/* The shell would wait for this child as well. */
+		if (shell->job_started_fd >= 0)
+			close(shell->job_started_fd);
+		child_move_fd(in_fd, STDIN_FILENO);
+		child_move_fd(out_fd, STDOUT_FILENO);
+		/* Not exit() - stdio buffers of the shell are not ours. */
+		_exit(b->run(cmd, STDIN_FILENO, STDOUT_FILENO));
 	}
-	else if (line->out_type == OUTPUT_TYPE_FILE_APPEND)
+	return pid;
+}
+
+/**
+ * Start an external command. posix_spawn() does not copy the page
+ * tables of the shell like fork() does - glibc runs the child on
+ * the parent's memory until exec. The stdin and stdout are set up
+ * by file actions, all the other fds of the shell are close-on-exec.
+ * Build with -DSHELL_USE_FORK to compare with fork() and exec.
+ * Returns -1 if the command could not start.
+ */
+static pid_t
+spawn_command(struct shell_state *shell, const struct command *cmd, int in_fd, int out_fd)
+{
+	char *argv[cmd->arg_count + 2];
+	argv[0] = cmd->exe;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i)
+		argv[i + 1] = cmd->args[i];
+	argv[cmd->arg_count + 1] = NULL;
+	/* Resolved in the parent, so as the result stays in the cache. */
+	const char *exe_path = path_cache_resolve(&shell->path_cache, cmd->exe);
+	++shell->process_count;
+#ifdef SHELL_USE_FORK
+	pid_t pid = fork();
+	if (pid == 0)
 	{
-		// printf("append file - \"%s\"\n", line->out_file);
+		signal(SIGPIPE, SIG_DFL);
+		child_move_fd(in_fd, STDIN_FILENO);
+		child_move_fd(out_fd, STDOUT_FILENO);
+		if (exe_path != NULL)
+			execv(exe_path, argv);
+		else
+			execvp(cmd->exe, argv);
+		_exit(127);
 	}
+	return pid;
+#else
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (in_fd != STDIN_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	if (out_fd != STDOUT_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+	/* The shell ignores SIGPIPE, the commands must not. */
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t sigdefault;
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigdefault);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+	pid_t pid;
+	int rc;
+	if (exe_path != NULL)
+		rc = posix_spawn(&pid, exe_path, &actions, &attr, argv, environ);
 	else
+		rc = posix_spawnp(&pid, cmd->exe, &actions, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	return rc == 0 ? pid : -1;
+#endif
+}
+
+/** Can a builtin write its output to @a out_fd without blocking forever. */
+static bool
+builtin_can_run_inline(const struct builtin *b, const struct command *cmd, bool is_last, int out_fd)
+{
+	if (is_last)
+		return true;
+	if (b->output_size == NULL)
+		return false;
+	size_t size = b->output_size(cmd);
+	if (size == 0)
+		return true;
+	int capacity = fcntl(out_fd, F_GETPIPE_SZ);
+	return capacity > 0 && size <= (size_t)capacity;
+}
+
+static double
+time_diff_ms(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/** A started stage of a pipeline, and what it used. */
+struct stage
+{
+	const char *name;
+	/** -1 if the stage ran in the shell or could not start. */
+	pid_t pid;
+	int pidfd;
+	int wstatus;
+	struct timespec start;
+	struct timespec end;
+	struct rusage usage;
+};
+
+/** Reap the stage and take its end time and rusage. */
+static void
+stage_reap(struct stage *st, int flags)
+{
+	while (wait4(st->pid, &st->wstatus, flags, &st->usage) < 0 && errno == EINTR)
+		;
+	clock_gettime(CLOCK_MONOTONIC, &st->end);
+	if (st->pidfd >= 0)
 	{
-		assert(false);
+		/* Removes it from the epoll as well. */
+		close(st->pidfd);
+		st->pidfd = -1;
 	}
-	// printf("Expressions:\n");
-	const struct expr *e = line->head;
-	int pipes_count = 0;
-	int cmd_id = 0;
-	*exit_status = 0;
+	st->pid = -1;
+}
 
-	count_pipes(line->head, &pipes_count);
+/**
+ * Wait for all the forked stages. Each stage's pidfd is in the
+ * epoll, so the stages are reaped in the order they end, and each
+ * gets its own end time. Stages without a pidfd are waited for in
+ * their order after the rest.
+ */
+static void
+stages_wait(struct shell_state *shell, struct stage *stages, int count)
+{
+	if (shell->stage_epoll_fd < 0)
+		shell->stage_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	int wait_count = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		struct stage *st = &stages[i];
+		if (st->pid < 0)
+			continue;
+		st->pidfd = shell->stage_epoll_fd >= 0 ? syscall(SYS_pidfd_open, st->pid, 0) : -1;
+		struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+		if (st->pidfd >= 0 && epoll_ctl(shell->stage_epoll_fd, EPOLL_CTL_ADD, st->pidfd, &ev) != 0)
+		{
+			close(st->pidfd);
+			st->pidfd = -1;
+		}
+		if (st->pidfd >= 0)
+			++wait_count;
+	}
+	while (wait_count > 0)
+	{
+		struct epoll_event events[16];
+		int rc = epoll_wait(shell->stage_epoll_fd, events, 16, -1);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			break;
+		for (int i = 0; i < rc; ++i)
+			stage_reap(&stages[events[i].data.u32], 0);
+		wait_count -= rc;
+	}
+	for (int i = 0; i < count; ++i)
+	{
+		if (stages[i].pid >= 0)
+			stage_reap(&stages[i], 0);
+	}
+}
 
-	int **fd = malloc(pipes_count * sizeof(int *) + pipes_count * sizeof(int) * 2);
-	int *child_pid = malloc((pipes_count + 1) * sizeof(int));
-	initialize_pipes(&pipes_count, fd);
+/** Print what each stage used, like `time` does for the pipeline. */
+static void
+stages_report(const struct stage *stages, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		const struct stage *st = &stages[i];
+		fprintf(stderr, "%d %s: real %.3f s, user %ld.%03ld s, sys %ld.%03ld s, ", i + 1, st->name,
+			time_diff_ms(&st->start, &st->end) / 1e3, (long)st->usage.ru_utime.tv_sec,
+			(long)st->usage.ru_utime.tv_usec / 1000, (long)st->usage.ru_stime.tv_sec,
+			(long)st->usage.ru_stime.tv_usec / 1000);
+		if (st->usage.ru_maxrss > 0)
+			fprintf(stderr, "max rss %ld KB\n", st->usage.ru_maxrss);
+		else
+			fprintf(stderr, "in the shell\n");
+	}
+}
 
-	while (e != NULL)
+/**
+ * Run one pipeline: the commands from @a e up to the next && or ||
+ * or the end of the line. @a out_fd is the stdout of the last
+ * command. Returns the exit status of the last command. With a
+ * `time` prefix, or -T, the resources of each stage are reported to
+ * stderr.
+ */
+static int
+execute_pipeline(struct shell_state *shell, const struct expr *e, int out_fd)
+{
+	int stage_count = 0;
+	for (const struct expr *it = e; it != NULL && it->type != EXPR_TYPE_AND && it->type != EXPR_TYPE_OR;
+	     it = it->next)
 	{
-		if (e->type == EXPR_TYPE_COMMAND)
+		if (it->type == EXPR_TYPE_COMMAND)
+			++stage_count;
+	}
+	struct stage stages[stage_count];
+	bool is_time = shell->is_time_all;
+	/* `time cmd` is cmd itself, `time` alone is a command. */
+	struct command first = e->cmd;
+	if (strcmp(first.exe, "time") == 0 && first.arg_count > 0)
+	{
+		is_time = true;
+		first.exe = first.args[0];
+		++first.args;
+		--first.arg_count;
+	}
+	if (stage_count == 1 && strcmp(first.exe, "cd") == 0)
+		return shell_cd(&first);
+	int status = 0;
+	/* The read end of the pipe from the previous stage. */
+	int in_fd = STDIN_FILENO;
+	for (int i = 0; i < stage_count; ++i, e = e->next)
+	{
+		while (e->type != EXPR_TYPE_COMMAND)
+			e = e->next;
+		bool is_last = i == stage_count - 1;
+		int pipe_fd[2] = {-1, -1};
+		int stage_out = out_fd;
+		if (!is_last)
 		{
-			// printf("\tArgs: %d\n", e->cmd.arg_count);
-			// printf("\tCommand: %s", e->cmd.exe);
-			// for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
-			// 	printf(" %s", e->cmd.args[i]);
-			// printf("\n");
+			/* Close-on-exec, so as only the stages get them. */
+			if (pipe2(pipe_fd, O_CLOEXEC) != 0)
+			{
+				perror("pipe");
+				pipe_fd[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+				pipe_fd[1] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+			}
+			else if (shell->pipe_size > 0)
+			{
+				/*
+				 * Best effort. Above /proc/sys/fs/pipe-max-size it
+				 * fails for a non-root user, the default size stays.
+				 */
+				fcntl(pipe_fd[1], F_SETPIPE_SZ, shell->pipe_size);
+			}
+			stage_out = pipe_fd[1];
+		}
 
-			*exit_status = execute_command(e, line, fd, child_pid, pipes_count, cmd_id);
-			if (*exit_status == 1){
-				break;
-			} else if (*exit_status == 2){
-				cmd_id--;
+		const struct command *cmd = i == 0 ? &first : &e->cmd;
+		struct stage *st = &stages[i];
+		memset(st, 0, sizeof(*st));
+		st->name = cmd->exe;
+		st->pid = -1;
+		st->pidfd = -1;
+		clock_gettime(CLOCK_MONOTONIC, &st->start);
+		const struct builtin *b = builtin_find(cmd);
+		if (b != NULL && builtin_can_run_inline(b, cmd, is_last, stage_out))
+		{
+			/* The stage can run long, the shell should not wait. */
+			job_notify_started(shell);
+			struct rusage before;
+			if (is_time)
+				getrusage(RUSAGE_SELF, &before);
+			status = b->run(cmd, in_fd, stage_out);
+			if (is_time)
+			{
+				getrusage(RUSAGE_SELF, &st->usage);
+				timersub(&st->usage.ru_utime, &before.ru_utime, &st->usage.ru_utime);
+				timersub(&st->usage.ru_stime, &before.ru_stime, &st->usage.ru_stime);
+				/* The shell's own RSS tells nothing about the stage. */
+				st->usage.ru_maxrss = 0;
 			}
-			cmd_id++;
 		}
-		else if (e->type == EXPR_TYPE_PIPE)
+		else if (b != NULL)
 		{
-			// printf("\tPIPE\n");
+			st->pid = fork_builtin(shell, b, cmd, in_fd, stage_out, pipe_fd[0]);
 		}
-		else if (e->type == EXPR_TYPE_AND)
+		else
 		{
-			// printf("\tAND\n");
+			st->pid = spawn_command(shell, cmd, in_fd, stage_out);
 		}
-		else if (e->type == EXPR_TYPE_OR)
+		clock_gettime(CLOCK_MONOTONIC, &st->end);
+		/* A command which could not start is "not found". */
+		if (b == NULL && st->pid < 0)
+			status = 127;
+
+		if (in_fd != STDIN_FILENO)
+			close(in_fd);
+		if (!is_last)
+			close(pipe_fd[1]);
+		in_fd = pipe_fd[0];
+	}
+	job_notify_started(shell);
+
+	struct stage *last = &stages[stage_count - 1];
+	bool is_last_forked = last->pid >= 0;
+	stages_wait(shell, stages, stage_count);
+	if (is_last_forked)
+		status = wait_status(last->wstatus);
+	if (is_time)
+		stages_report(stages, stage_count);
+	return status;
+}
+
+/**
+ * Execute the line in the shell process and wait for it. Pipelines
+ * are joined by && and ||, which run the next pipeline only if the
+ * previous one succeeded or failed. @a status is the exit status of
+ * the last command, it is updated. Returns true if the shell must
+ * exit.
+ */
+static bool
+execute_foreground(struct shell_state *shell, const struct command_line *line, int *status)
+{
+	assert(line != NULL);
+	const struct expr *e = line->head;
+	if (e->next == NULL && strcmp(e->cmd.exe, "exit") == 0)
+	{
+		if (e->cmd.arg_count > 0)
+			*status = atoi(e->cmd.args[0]) & 0xff;
+		return true;
+	}
+
+	/* The output redirect belongs to the last pipeline. */
+	int out_fd = STDOUT_FILENO;
+	if (line->out_type != OUTPUT_TYPE_STDOUT)
+	{
+		int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+		flags |= line->out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND;
+		out_fd = open(line->out_file, flags, S_IRUSR | S_IWUSR);
+		if (out_fd < 0)
 		{
-			// printf("\tOR\n");
+			perror(line->out_file);
+			*status = 1;
+			return false;
 		}
-		else
+	}
+
+	bool is_skipped = false;
+	while (e != NULL)
+	{
+		const struct expr *next = e;
+		while (next != NULL && next->type != EXPR_TYPE_AND && next->type != EXPR_TYPE_OR)
+			next = next->next;
+		if (!is_skipped)
+			*status = execute_pipeline(shell, e, next == NULL ? out_fd : STDOUT_FILENO);
+		if (next == NULL)
+			break;
+		/* A skipped pipeline keeps the status for the next operator. */
+		is_skipped = next->type == EXPR_TYPE_AND ? *status != 0 : *status == 0;
+		e = next->next;
+	}
+	if (out_fd != STDOUT_FILENO)
+		close(out_fd);
+	return false;
+}
+
+/*
+ * Background jobs. A job is a forked copy of the shell which runs
+ * the whole line, so as && and || work there too, and exit ends
+ * only the job. The shell keeps a pidfd of each job. The input loop
+ * polls them together with stdin, so finished jobs are reaped as
+ * soon as they end instead of staying zombies, and foreground lines
+ * wait only for their own processes.
+ */
+
+static void
+job_start(struct shell_state *shell, const struct command_line *line)
+{
+	/*
+	 * The shell waits until the job starts its first pipeline. Else
+	 * the next foreground lines can easily get ahead of the job and
+	 * reorder the output of `sleep 1 && echo job &` and `sleep 1`.
+	 */
+	int started_fd[2];
+	if (pipe2(started_fd, O_CLOEXEC) != 0)
+		started_fd[0] = started_fd[1] = -1;
+	/* Or the child would print the same buffered output again. */
+	fflush(stdout);
+	++shell->process_count;
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		if (started_fd[0] >= 0)
+		{
+			close(started_fd[0]);
+			close(started_fd[1]);
+		}
+		return;
+	}
+	if (pid == 0)
+	{
+		if (started_fd[0] >= 0)
+			close(started_fd[0]);
+		shell->job_started_fd = started_fd[1];
+		/* An epoll is shared after fork(), the job needs its own. */
+		if (shell->stage_epoll_fd >= 0)
 		{
-			assert(false);
+			close(shell->stage_epoll_fd);
+			shell->stage_epoll_fd = -1;
 		}
-		e = e->next;
+		/* The shell's input is not for the job. */
+		int fd = open("/dev/null", O_RDONLY);
+		if (fd >= 0)
+		{
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+		}
+		int status = 0;
+		execute_foreground(shell, line, &status);
+		fflush(stdout);
+		_exit(status);
+	}
+	if (started_fd[0] >= 0)
+	{
+		close(started_fd[1]);
+		char c;
+		while (read(started_fd[0], &c, 1) < 0 && errno == EINTR)
+			;
+		close(started_fd[0]);
+	}
+	struct job_table *table = &shell->job_table;
+	if (table->count == table->capacity)
+	{
+		table->capacity = (table->capacity + 1) * 2;
+		table->jobs = realloc(table->jobs, table->capacity * sizeof(*table->jobs));
 	}
+	struct job *job = &table->jobs[table->count++];
+	job->id = ++table->next_id;
+	job->pid = pid;
+	job->pidfd = syscall(SYS_pidfd_open, pid, 0);
+}
 
-	for (int i = 0; i < pipes_count; i++)
+/** Reap the finished jobs, without blocking. */
+static void
+job_table_reap(struct job_table *table)
+{
+	for (uint32_t i = 0; i < table->count;)
 	{
-		close(fd[i][0]);
-		close(fd[i][1]);
+		struct job *job = &table->jobs[i];
+		int wstatus;
+		if (waitpid(job->pid, &wstatus, WNOHANG) == 0)
+		{
+			++i;
+			continue;
+		}
+		if (job->pidfd >= 0)
+			close(job->pidfd);
+		*job = table->jobs[--table->count];
 	}
+}
 
-	int wstatus;
-	for (int i = 0; i < pipes_count + 1; i++)
+/**
+ * Wait until stdin has data, reaping the jobs which end meanwhile.
+ * Without pidfds the jobs are reaped only when the input comes.
+ */
+static void
+job_table_wait_input(struct job_table *table)
+{
+	while (table->count > 0)
+	{
+		struct pollfd fds[table->count + 1];
+		nfds_t fd_count = 0;
+		fds[fd_count++] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
+		for (uint32_t i = 0; i < table->count; ++i)
+		{
+			if (table->jobs[i].pidfd >= 0)
+				fds[fd_count++] = (struct pollfd){table->jobs[i].pidfd, POLLIN, 0};
+		}
+		if (poll(fds, fd_count, -1) < 0 && errno != EINTR)
+			return;
+		job_table_reap(table);
+		if (fds[0].revents != 0)
+			return;
+	}
+}
+
+/** The jobs still running are left to run on their own. */
+static void
+job_table_destroy(struct job_table *table)
+{
+	for (uint32_t i = 0; i < table->count; ++i)
+	{
+		if (table->jobs[i].pidfd >= 0)
+			close(table->jobs[i].pidfd);
+	}
+	free(table->jobs);
+	memset(table, 0, sizeof(*table));
+}
+
+/**
+ * Execute the line: in the foreground, or as a background job if it
+ * ends with &. Returns true if the shell must exit.
+ */
+static bool
+execute_command_line(struct shell_state *shell, const struct command_line *line, int *status)
+{
+	if (!line->is_background)
+		return execute_foreground(shell, line, status);
+	job_start(shell, line);
+	*status = 0;
+	return false;
+}
+
+/** A line of a script, parsed before anything is executed. */
+struct script_line
+{
+	struct command_line *line;
+	enum parser_error err;
+};
+
+/**
+ * Run a script file. It is mapped and parsed as a whole before the
+ * first command starts. With @a is_timed each line's time goes to
+ * stderr. @a status is the exit status of the last command.
+ * Returns -1 if the script can't be read.
+ */
+static int
+run_script(struct shell_state *shell, const char *path, bool is_timed, int *status)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct parser *p = parser_new();
+	if (st.st_size > 0)
 	{
-		waitpid(child_pid[i], &wstatus, 0);
-		if (WIFEXITED(wstatus))
+		char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
 		{
-			// printf("parent: child_%d exited normally with status %d\n", i, WEXITSTATUS(wstatus));
+			perror(path);
+			close(fd);
+			parser_delete(p);
+			return -1;
 		}
-		if (WIFSIGNALED(wstatus))
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		parser_feed(p, data, st.st_size);
+		/* The last line can lack the new line. */
+		if (data[st.st_size - 1] != '\n')
+			parser_feed(p, "\n", 1);
+		munmap(data, st.st_size);
+	}
+	close(fd);
+
+	struct script_line *lines = NULL;
+	size_t line_count = 0;
+	size_t line_capacity = 0;
+	while (true)
+	{
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		if (line_count == line_capacity)
 		{
-			// printf("parent: child_%d was terminated by signal %d\n", i, WTERMSIG(wstatus));
+			line_capacity = (line_capacity + 1) * 2;
+			lines = realloc(lines, line_capacity * sizeof(*lines));
 		}
+		lines[line_count].line = line;
+		lines[line_count].err = err;
+		++line_count;
 	}
+	parser_delete(p);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (is_timed)
+		fprintf(stderr, "parsed %zu lines in %.3f ms\n", line_count, time_diff_ms(&start, &end));
 
-	free_cmd_atributes(fd, child_pid);
+	bool is_exit = false;
+	struct timespec run_start;
+	clock_gettime(CLOCK_MONOTONIC, &run_start);
+	size_t i = 0;
+	for (; i < line_count && !is_exit; ++i)
+	{
+		if (lines[i].err != PARSER_ERR_NONE)
+		{
+			printf("Error: %d\n", (int)lines[i].err);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		is_exit = execute_command_line(shell, lines[i].line, status);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		job_table_reap(&shell->job_table);
+		if (is_timed)
+		{
+			fprintf(stderr, "line %zu: %.3f ms: %s\n", i + 1, time_diff_ms(&start, &end),
+				lines[i].line->head->cmd.exe);
+		}
+	}
+	if (is_timed)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(stderr, "ran %zu lines in %.3f ms, %lld processes\n", i,
+			time_diff_ms(&run_start, &end), shell->process_count);
+	}
+	for (i = 0; i < line_count; ++i)
+	{
+		if (lines[i].line != NULL)
+			command_line_delete(lines[i].line);
+	}
+	free(lines);
+	return 0;
 }
 
-int main(void)
+static void
+shell_state_create(struct shell_state *shell)
 {
+	memset(shell, 0, sizeof(*shell));
+	shell->job_started_fd = -1;
+	shell->stage_epoll_fd = -1;
+}
+
+static void
+shell_state_destroy(struct shell_state *shell)
+{
+	job_table_destroy(&shell->job_table);
+	path_cache_destroy(&shell->path_cache);
+	if (shell->stage_epoll_fd >= 0)
+		close(shell->stage_epoll_fd);
+}
+
+/**
+ * Usage: a.out [-t] [-T] [-p size] [script]. Without a script the
+ * commands are read from stdin as they come. -t reports the time of
+ * each script line to stderr. -T reports the real, user and sys time
+ * and the max RSS of each pipeline stage, as a `time` prefix does
+ * for one pipeline. -p sets the size of the pipes between stages,
+ * bigger pipes mean fewer wakeups on heavy streams. The exit code
+ * is the one of the last command.
+ */
+int main(int argc, char **argv)
+{
+	/* In-process builtins get EPIPE instead of killing the shell. */
+	signal(SIGPIPE, SIG_IGN);
+	struct shell_state shell;
+	shell_state_create(&shell);
+	bool is_timed = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "tTp:")) != -1)
+	{
+		if (opt == 't')
+			is_timed = true;
+		else if (opt == 'T')
+			shell.is_time_all = true;
+		else if (opt == 'p')
+			shell.pipe_size = atoi(optarg);
+		else
+			return 1;
+	}
+	int status = 0;
+	if (optind < argc)
+	{
+		int rc = run_script(&shell, argv[optind], is_timed, &status);
+		shell_state_destroy(&shell);
+		return rc == 0 ? status : 1;
+	}
+
 	const size_t buf_size = 1024;
 	char buf[buf_size];
 	int rc;
-	int exit_status = 0;
+	bool is_exit = false;
 	struct parser *p = parser_new();
-	while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0)
+	while (!is_exit)
 	{
+		job_table_wait_input(&shell.job_table);
+		if ((rc = read(STDIN_FILENO, buf, buf_size)) <= 0)
+			break;
 		parser_feed(p, buf, rc);
 		struct command_line *line = NULL;
-		while (true)
+		while (!is_exit)
 		{
 			enum parser_error err = parser_pop_next(p, &line);
 			if (err == PARSER_ERR_NONE && line == NULL)
@@ -279,15 +1465,11 @@ int main(void)
 				printf("Error: %d\n", (int)err);
 				continue;
 			}
-			execute_command_line(line, &exit_status);
+			is_exit = execute_command_line(&shell, line, &status);
 			command_line_delete(line);
 		}
-
-		if (exit_status == 1)
-		{
-			break;
-		}
 	}
 	parser_delete(p);
-	return 0;
+	shell_state_destroy(&shell);
+	return status;
 }
@@ -70,6 +70,76 @@ test_stress_open(void)
 	unit_test_finish();
 }
 
+static void
+test_stress_many_files(void)
+{
+	unit_test_start();
+
+	const int count = 100000;
+	const int kept_count = count / 1000;
+	int kept[kept_count];
+	char name[32], buf[32];
+	unit_msg("create %d files, each with its name inside", count);
+	for (int i = 0; i < count; ++i) {
+		int name_len = sprintf(name, "many_file%d", i) + 1;
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, name_len) != name_len);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_msg("find each one by name");
+	for (int i = 0; i < count; ++i) {
+		int name_len = sprintf(name, "many_file%d", i) + 1;
+		int fd = ufs_open(name, UFS_READ_ONLY);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_read(fd, buf, sizeof(buf)) != name_len);
+		unit_fail_if(memcmp(buf, name, name_len) != 0);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_msg("delete all, keep some of them opened");
+	for (int i = 0; i < kept_count; ++i) {
+		sprintf(name, "many_file%d", i * 1000);
+		kept[i] = ufs_open(name, 0);
+		unit_fail_if(kept[i] == -1);
+	}
+	/*
+	 * Newest first - the leak detector looks for each freed block
+	 * from the newest one, it would be quadratic otherwise.
+	 */
+	for (int i = count - 1; i >= 0; --i) {
+		sprintf(name, "many_file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "many_file%d", i);
+		unit_fail_if(ufs_open(name, 0) != -1);
+		unit_fail_if(ufs_delete(name) != -1);
+	}
+	unit_msg("deleted files are readable by their descriptors");
+	for (int i = 0; i < kept_count; ++i) {
+		int name_len = sprintf(name, "many_file%d", i * 1000) + 1;
+		unit_fail_if(ufs_read(kept[i], buf, sizeof(buf)) != name_len);
+		unit_fail_if(memcmp(buf, name, name_len) != 0);
+	}
+	unit_msg("the same names are new empty files now");
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "many_file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_read(fd, buf, sizeof(buf)) != 0);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	for (int i = 0; i < kept_count; ++i)
+		unit_fail_if(ufs_close(kept[i]) != 0);
+	for (int i = count - 1; i >= 0; --i) {
+		sprintf(name, "many_file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ufs_open("many_file0", 0) == -1, "all deleted");
+
+	unit_test_finish();
+}
+
 static void
 test_close(void)
 {
@@ -479,6 +549,7 @@ main(void)
 	test_io();
 	test_delete();
 	test_stress_open();
+	test_stress_many_files();
 	test_max_file_size();
 	test_rights();
 	test_resize();
@@ -1,5 +1,7 @@
 #include "userfs.h"
+#include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -45,10 +47,147 @@ struct file
     int is_deleted;
     int blocks_count;
     size_t size;
+    /** Hash of the name, to find the file in the index. */
+    uint32_t name_hash;
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+enum file_index_slot_state
+{
+    FILE_INDEX_SLOT_FREE = 0,
+    FILE_INDEX_SLOT_TAKEN,
+    /**
+     * The file was deleted. The slot is not free, so as the probe
+     * chains going through it are not broken.
+     */
+    FILE_INDEX_SLOT_DELETED,
+};
+
+struct file_index_slot
+{
+    struct file *file;
+    uint32_t hash;
+    enum file_index_slot_state state;
+};
+
+/**
+ * All the files. They are in the list until the last descriptor is
+ * closed, and in the index by name until they are deleted. The
+ * index is open addressing with linear probing. A slot caches the
+ * name hash, so as most of the mismatches are seen without strcmp().
+ */
+struct file_table
+{
+    /** List of all files. */
+    struct file *list;
+    struct file_index_slot *index;
+    /** A power of 2. */
+    uint32_t index_capacity;
+    /** Slots taken by files and deleted files. */
+    uint32_t index_used;
+    uint32_t index_count;
+};
+
+static struct file_table file_table;
+
+static uint32_t
+file_name_hash(const char *name)
+{
+    /* FNV-1a. */
+    uint32_t hash = 2166136261u;
+    for (; *name != 0; ++name)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct file *
+file_index_find(struct file_table *table, const char *name, uint32_t hash)
+{
+    if (table->index_capacity == 0)
+    {
+        return NULL;
+    }
+    uint32_t mask = table->index_capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        struct file_index_slot *slot = &table->index[i];
+        if (slot->state == FILE_INDEX_SLOT_FREE)
+        {
+            return NULL;
+        }
+        if (slot->state == FILE_INDEX_SLOT_TAKEN && slot->hash == hash && strcmp(slot->file->name, name) == 0)
+        {
+            return slot->file;
+        }
+    }
+}
+
+/** Put the file into the first free or deleted slot of its chain. */
+static void
+file_index_put(struct file_table *table, struct file *file)
+{
+    uint32_t mask = table->index_capacity - 1;
+    uint32_t i = file->name_hash & mask;
+    while (table->index[i].state == FILE_INDEX_SLOT_TAKEN)
+    {
+        i = (i + 1) & mask;
+    }
+    if (table->index[i].state == FILE_INDEX_SLOT_FREE)
+    {
+        ++table->index_used;
+    }
+    table->index[i].file = file;
+    table->index[i].hash = file->name_hash;
+    table->index[i].state = FILE_INDEX_SLOT_TAKEN;
+    ++table->index_count;
+}
+
+static void
+file_index_insert(struct file_table *table, struct file *file)
+{
+    /* Keep at most 3/4 of the slots taken, deleted ones included. */
+    if ((table->index_used + 1) * 4 > table->index_capacity * 3)
+    {
+        struct file_index_slot *old = table->index;
+        uint32_t old_capacity = table->index_capacity;
+        uint32_t new_capacity = 16;
+        /* Sized by the live files, the deleted ones are dropped. */
+        while ((table->index_count + 1) * 2 > new_capacity)
+        {
+            new_capacity *= 2;
+        }
+        table->index = calloc(new_capacity, sizeof(*table->index));
+        table->index_capacity = new_capacity;
+        table->index_used = 0;
+        table->index_count = 0;
+        for (uint32_t i = 0; i < old_capacity; ++i)
+        {
+            if (old[i].state == FILE_INDEX_SLOT_TAKEN)
+            {
+                file_index_put(table, old[i].file);
+            }
+        }
+        free(old);
+    }
+    file_index_put(table, file);
+}
+
+static void
+file_index_remove(struct file_table *table, struct file *file)
+{
+    uint32_t mask = table->index_capacity - 1;
+    uint32_t i = file->name_hash & mask;
+    while (table->index[i].state != FILE_INDEX_SLOT_TAKEN || table->index[i].file != file)
+    {
+        assert(table->index[i].state != FILE_INDEX_SLOT_FREE);
+        i = (i + 1) & mask;
+    }
+    table->index[i].file = NULL;
+    table->index[i].state = FILE_INDEX_SLOT_DELETED;
+    --table->index_count;
+}
 
 struct filedesc
 {
@@ -78,20 +217,8 @@ int ufs_open(const char *filename, int flags)
     if (flags == UFS_CREATE)
     {
         int file_descriptor_index = -1;
-        struct file *existing_file = NULL;
-        struct file *last_file_in_list = NULL;
-        struct file *file_list_copy = file_list;
-
-        while (file_list_copy != NULL)
-        {
-            if (strcmp(file_list_copy->name, filename) == 0 && file_list_copy->is_deleted == 0)
-            {
-                existing_file = file_list_copy;
-                break;
-            }
-            last_file_in_list = file_list_copy;
-            file_list_copy = file_list_copy->next;
-        }
+        uint32_t name_hash = file_name_hash(filename);
+        struct file *existing_file = file_index_find(&file_table, filename, name_hash);
 
         struct file *new_file;
         if (existing_file == NULL)
@@ -104,20 +231,18 @@ int ufs_open(const char *filename, int flags)
             new_file->is_deleted = 0;
             new_file->block_list_head = NULL;
             new_file->block_list_tail = NULL;
+            new_file->name_hash = name_hash;
             strcpy(new_file->name, filename);
 
-            if (last_file_in_list == NULL)
+            /* The order does not matter, the head is not searched for. */
+            new_file->prev = NULL;
+            new_file->next = file_table.list;
+            if (file_table.list != NULL)
             {
-                new_file->prev = NULL;
-                new_file->next = NULL;
-                file_list = new_file;
-            }
-            else
-            {
-                new_file->prev = last_file_in_list;
-                new_file->next = NULL;
-                last_file_in_list->next = new_file;
+                file_table.list->prev = new_file;
             }
+            file_table.list = new_file;
+            file_index_insert(&file_table, new_file);
         }
         else
         {
@@ -164,18 +289,7 @@ int ufs_open(const char *filename, int flags)
     else
     {
         int file_descriptor_index = -1;
-        struct file *existing_file = NULL;
-        struct file *file_list_copy = file_list;
-
-        while (file_list_copy != NULL)
-        {
-            if (strcmp(file_list_copy->name, filename) == 0 && file_list_copy->is_deleted == 0)
-            {
-                existing_file = file_list_copy;
-                break;
-            }
-            file_list_copy = file_list_copy->next;
-        }
+        struct file *existing_file = file_index_find(&file_table, filename, file_name_hash(filename));
 
         if (existing_file == NULL)
         {
@@ -490,7 +604,7 @@ int ufs_close(int fd)
             }
             else
             {
-                file_list = closing_file->next;
+                file_table.list = closing_file->next;
             }
             if (closing_file->next != NULL)
             {
@@ -511,17 +625,7 @@ int ufs_close(int fd)
 
 int ufs_delete(const char *filename)
 {
-    struct file *existing_file = NULL;
-    struct file *file_list_copy = file_list;
-    while (file_list_copy != NULL)
-    {
-        if (strcmp(file_list_copy->name, filename) == 0 && file_list_copy->is_deleted == 0)
-        {
-            existing_file = file_list_copy;
-            break;
-        }
-        file_list_copy = file_list_copy->next;
-    }
+    struct file *existing_file = file_index_find(&file_table, filename, file_name_hash(filename));
 
     if (existing_file == NULL)
     {
@@ -531,6 +635,7 @@ int ufs_delete(const char *filename)
     else
     {
         existing_file->is_deleted = 1;
+        file_index_remove(&file_table, existing_file);
 
         if (existing_file->refs == 0)
         {
@@ -560,7 +665,7 @@ int ufs_delete(const char *filename)
             }
             else
             {
-                file_list = closing_file->next;
+                file_table.list = closing_file->next;
             }
             if (closing_file->next != NULL)
             {
@@ -578,7 +683,7 @@ int ufs_delete(const char *filename)
 
 void ufs_destroy(void)
 {
-    struct file *file_list_copy = file_list;
+    struct file *file_list_copy = file_table.list;
 
     while (file_list_copy != NULL)
     {
@@ -624,6 +729,8 @@ void ufs_destroy(void)
     }
 
     free(file_descriptors);
+    free(file_table.index);
+    memset(&file_table, 0, sizeof(file_table));
 }
 
 int